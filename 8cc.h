@@ -40,6 +40,7 @@ typedef struct Map {
     struct Map *parent;
     char **key;
     void **val;
+    uint32_t *hash; // hash of each key, so that it is computed only once
     int size;
     int nelem;
     int nused;
@@ -57,8 +58,9 @@ typedef struct {
 } Dict;
 
 typedef struct Set {
-    char *v;
-    struct Set *next;
+    int len;
+    uint32_t hash;
+    char *v[];   // sorted by address
 } Set;
 
 typedef struct {
@@ -68,8 +70,9 @@ typedef struct {
 } Buffer;
 
 typedef struct {
-    FILE *file;  // stream backed by FILE *
-    char *p;     // stream backed by string
+    char *p;     // next character to read
+    char *end;   // end of the file contents, NULL if string-backed
+    char *data;  // file contents, freed when the file is closed
     char *name;
     int line;
     int column;
@@ -78,6 +81,8 @@ typedef struct {
     int buf[3];   // push-back buffer for unread operations
     int buflen;   // push-back buffer size
     time_t mtime; // last modified time. 0 if string-backed file
+    long mtime_ns; // nanoseconds of the last modified time
+    long size;    // size on disk
 } File;
 
 typedef struct {
@@ -130,6 +135,7 @@ enum {
     AST_GOTO,
     AST_COMPUTED_GOTO,
     AST_LABEL,
+    AST_SWITCH,
     OP_SIZEOF,
     OP_CAST,
     OP_SHR,
@@ -278,9 +284,39 @@ typedef struct Node {
             char *field;
             Type *fieldtype;
         };
+        // Switch dispatch
+        struct {
+            struct Node *switchexpr;
+            Vector *switchcases;
+            char *switchdefault;
+        };
     };
 } Node;
 
+// A case label; [GNU] beg < end for "case beg ... end"
+typedef struct {
+    int beg;
+    int end;
+    char *label;
+} Case;
+
+enum {
+    INSN_OP,      // instruction
+    INSN_MODE,    // .a8, .a16, .i8 or .i16
+    INSN_LABEL,
+    INSN_COMMENT,
+    INSN_OTHER,   // any other directive
+};
+
+// A line of assembly buffered for the peephole optimizer
+typedef struct {
+    int kind;
+    int line;     // line in gen.c that emitted it
+    char *op;     // mnemonic, directive or label name
+    char *arg;    // operand or NULL
+    char *text;
+} Insn;
+
 extern Type *type_void;
 extern Type *type_bool;
 extern Type *type_char;
@@ -296,10 +332,40 @@ extern Type *type_ullong;
 extern Type *type_float;
 extern Type *type_double;
 extern Type *type_ldouble;
+extern Type *type_enum;
 
 #define EMPTY_MAP ((Map){})
 #define EMPTY_VECTOR ((Vector){})
 
+// alloc.c
+typedef struct {
+    void *chunks;
+    char *p;
+    char *end;
+    size_t live;
+} AllocMark;
+
+enum {
+    ALLOC_TOKEN,
+    ALLOC_NODE,
+    ALLOC_GLOBAL, // nodes bound in the global environment
+    ALLOC_TYPE,
+    ALLOC_BUFFER,
+    ALLOC_SET,
+    ALLOC_MACRO,
+    ALLOC_ATOM,
+    ALLOC_OTHER,
+    ALLOC_NKIND,
+};
+
+void *alloc(int kind, size_t size);
+void *alloc_copy(int kind, void *src, size_t size);
+AllocMark alloc_mark(int kind);
+void alloc_release(int kind, AllocMark m);
+void print_alloc_stats(void);
+void alloc_totals(size_t *count, size_t *bytes);
+size_t alloc_take_peak(void);
+
 // encoding.c
 Buffer *to_utf16(char *p, int len);
 Buffer *to_utf32(char *p, int len);
@@ -318,6 +384,24 @@ char *quote_cstring(char *p);
 char *quote_cstring_len(char *p, int len);
 char *quote_char(char c);
 
+// pch.c
+typedef struct Pch Pch;
+
+void pch_put_int(Pch *p, int v);
+void pch_put_str(Pch *p, char *s);
+void pch_put_type(Pch *p, Type *ty);
+void pch_put_node(Pch *p, Node *node);
+void pch_put_token(Pch *p, Token *tok);
+int pch_get_int(Pch *p);
+char *pch_get_str(Pch *p);
+char *pch_get_atom(Pch *p);
+Type *pch_get_type(Pch *p);
+Node *pch_get_node(Pch *p);
+Token *pch_get_token(Pch *p);
+void save_pch(char *path, char *header, char *defs, int first_file, Vector *decls);
+Vector *load_pch(char *path, char *header, char *defs);
+bool pch_is_current(char *path, char *header, char *defs);
+
 // cpp.c
 void read_from_string(char *buf);
 bool is_ident(Token *tok, char *s);
@@ -325,8 +409,11 @@ void expect_newline(void);
 void add_include_path(char *path);
 void init_now(void);
 void cpp_init(void);
+Vector *include_path(void);
 Token *peek_token(void);
 Token *read_token(void);
+void write_cpp_state(Pch *p);
+void read_cpp_state(Pch *p);
 
 // debug.c
 char *ty2s(Type *ty);
@@ -357,24 +444,47 @@ void warnf(char *line, char *pos, char *fmt, ...);
 char *token_pos(Token *tok);
 
 // file.c
+enum {
+    SPAN_IDENT,         // identifier characters
+    SPAN_SPACE,         // spaces other than newline
+    SPAN_LINE_COMMENT,  // up to a newline
+    SPAN_BLOCK_COMMENT, // up to a '*'
+};
+
 File *make_file(FILE *file, char *name);
 File *make_file_string(char *s);
 int readc(void);
 void unreadc(int c);
+int read_span(int kind, char **start);
 File *current_file(void);
 void stream_push(File *file);
 int stream_depth(void);
 char *input_position(void);
 void stream_stash(File *f);
 void stream_unstash(void);
+Vector *input_files(void);
+
+// fold.c
+void fold_toplevel(Node *v);
 
 // gen.c
+extern bool dptemps;
+extern bool dpframe;
+extern bool peepopt;
+extern bool costreport;
+
 void set_output_file(FILE *fp);
 void close_output_file(void);
 void emit_toplevel(Node *v);
 
+// intern.c
+char *intern_len(char *p, int len);
+char *intern(char *s);
+bool atom_hash(char *s, uint32_t *h);
+
 // lex.c
-void lex_init(char *filename);
+void lex_init(void);
+void lex_open(char *filename);
 char *get_base_file(void);
 void skip_cond_incl(void);
 char *read_header_file_name(bool *std);
@@ -386,12 +496,14 @@ Token *lex_string(char *s);
 Token *lex(void);
 
 // map.c
+uint32_t fnv_hash(void *p, int len);
 Map *make_map(void);
 Map *make_map_parent(Map *parent);
 void *map_get(Map *m, char *key);
 void map_put(Map *m, char *key, void *val);
 void map_remove(Map *m, char *key);
 size_t map_len(Map *m);
+Vector *map_keys(Map *m);
 
 // parse.c
 char *make_tempname(void);
@@ -401,9 +513,36 @@ bool is_flotype(Type *ty);
 void *make_pair(void *first, void *second);
 int eval_intexpr(Node *node, Node **addr);
 Node *read_expr(void);
+Vector *read_toplevel(void);
 Vector *read_toplevels(void);
 void parse_init(void);
 char *fullpath(char *path);
+void write_parse_state(Pch *p);
+void read_parse_state(Pch *p);
+
+// peep.c
+Insn *make_insn(int line, char *text);
+char *invert_branch(char *op);
+void peephole(Vector *insns);
+void relax_branches(Vector *insns);
+void insn_cost(Insn *p, bool m8, bool x8, int *bytes, int *cycles);
+
+// server.c
+typedef struct {
+    // Returns the options of a command line that the warm state depends on
+    Vector *(*config)(int argc, char **argv);
+    // Sets up the warm state for those options
+    void (*warm_up)(Vector *config);
+    // Returns false if the warm state is out of date
+    bool (*is_current)(void);
+    // Compiles a command line, and returns the exit status
+    int (*compile)(int argc, char **argv);
+    // Returns the assembly files the compilation made
+    Vector *(*outputs)(void);
+} Compiler;
+
+noreturn void run_server(char *path, Compiler *cc, int argc, char **argv);
+int run_client(char *path, int argc, char **argv);
 
 // set.c
 Set *set_add(Set *s, char *v);
@@ -411,6 +550,29 @@ bool set_has(Set *s, char *v);
 Set *set_union(Set *a, Set *b);
 Set *set_intersection(Set *a, Set *b);
 
+// timing.c
+enum {
+    PHASE_OTHER,
+    PHASE_READ,    // reading files
+    PHASE_LEX,
+    PHASE_CPP,     // macro expansion and directives
+    PHASE_PARSE,
+    PHASE_FOLD,
+    PHASE_CODEGEN,
+    PHASE_NUM,
+};
+
+extern bool timereport;
+extern bool timereport_json;
+
+long time_now(void);
+void timing_start(void);
+void phase_enter(int phase);
+void phase_exit(void);
+void record_func_time(char *name, long ns);
+void record_macro_time(char *name, long ns);
+void print_time_report(char *file);
+
 // vector.c
 Vector *make_vector(void);
 Vector *make_vector1(void *e);
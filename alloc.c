@@ -0,0 +1,158 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Arenas for the small objects the compiler allocates by the million.
+ *
+ * 8cc never frees memory (see HACKING.md), so there is no reason to
+ * pay for malloc's bookkeeping on every token and AST node. Each kind
+ * of object gets its own arena: objects are carved out of large
+ * zero-filled chunks by bumping a pointer, and objects of the same
+ * kind end up next to each other in memory.
+ *
+ * Keeping the kinds apart also means that all nodes, say, live in
+ * chunks of their own, so they can be freed in bulk. main() releases
+ * the nodes of each toplevel once it is emitted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#define CHUNK_SIZE (256 * 1024)
+#define ALIGN 16
+
+typedef struct Chunk {
+    struct Chunk *next;
+} Chunk;
+
+// Chunk data starts after the header, at an aligned address
+#define HEADER_SIZE ALIGN
+
+typedef struct {
+    Chunk *chunks; // all chunks, the newest first
+    char *p;       // next free byte in the current chunk
+    char *end;     // end of the current chunk
+    size_t bytes;  // bytes handed out
+    size_t count;  // objects handed out
+    size_t live;   // bytes in use, not counting released ones
+    size_t peak;   // the highest value of live
+    int nchunk;
+} Arena;
+
+static Arena arenas[ALLOC_NKIND];
+
+// Over all kinds, for -ftime-report
+static size_t total_count;
+static size_t total_bytes;
+static size_t total_live;
+static size_t max_live;  // the highest total_live since alloc_take_peak()
+
+static char *kind_names[] = {
+    [ALLOC_TOKEN] = "token",
+    [ALLOC_NODE] = "node",
+    [ALLOC_GLOBAL] = "global",
+    [ALLOC_TYPE] = "type",
+    [ALLOC_BUFFER] = "buffer",
+    [ALLOC_SET] = "set",
+    [ALLOC_MACRO] = "macro",
+    [ALLOC_ATOM] = "atom",
+    [ALLOC_OTHER] = "other",
+};
+
+static void *new_chunk(Arena *a, size_t size) {
+    Chunk *c = calloc(1, HEADER_SIZE + size);
+    if (!c)
+        error("out of memory");
+    c->next = a->chunks;
+    a->chunks = c;
+    a->nchunk++;
+    return (char *)c + HEADER_SIZE;
+}
+
+// Returns size zero-filled bytes from the arena of the given kind.
+void *alloc(int kind, size_t size) {
+    Arena *a = &arenas[kind];
+    size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    a->bytes += size;
+    a->count++;
+    a->live += size;
+    if (a->live > a->peak)
+        a->peak = a->live;
+    total_count++;
+    total_bytes += size;
+    total_live += size;
+    if (total_live > max_live)
+        max_live = total_live;
+    // A large object gets a chunk of its own, so that the rest of
+    // the current chunk is not wasted.
+    if (size > CHUNK_SIZE / 4)
+        return new_chunk(a, size);
+    if (a->end - a->p < size) {
+        a->p = new_chunk(a, CHUNK_SIZE);
+        a->end = a->p + CHUNK_SIZE;
+    }
+    void *r = a->p;
+    a->p += size;
+    return r;
+}
+
+void *alloc_copy(int kind, void *src, size_t size) {
+    void *r = alloc(kind, size);
+    memcpy(r, src, size);
+    return r;
+}
+
+AllocMark alloc_mark(int kind) {
+    Arena *a = &arenas[kind];
+    return (AllocMark){ a->chunks, a->p, a->end, a->live };
+}
+
+// Frees everything allocated from the arena of the given kind since m
+// was taken.
+void alloc_release(int kind, AllocMark m) {
+    Arena *a = &arenas[kind];
+    while (a->chunks != m.chunks) {
+        Chunk *c = a->chunks;
+        a->chunks = c->next;
+        a->nchunk--;
+        free(c);
+    }
+    // alloc() promises zero-filled memory, so clear what was used
+    // of the chunk we return to.
+    if (m.p) {
+        char *used = (a->end == m.end) ? a->p : m.end;
+        memset(m.p, 0, used - m.p);
+    }
+    a->p = m.p;
+    a->end = m.end;
+    total_live -= a->live - m.live;
+    a->live = m.live;
+}
+
+void alloc_totals(size_t *count, size_t *bytes) {
+    *count = total_count;
+    *bytes = total_bytes;
+}
+
+// Returns the most bytes in use since the last call.
+size_t alloc_take_peak() {
+    size_t r = max_live;
+    max_live = total_live;
+    return r;
+}
+
+void print_alloc_stats(void) {
+    fprintf(stderr, "%-8s %10s %12s %12s %8s\n", "kind", "objects", "bytes", "peak", "chunks");
+    size_t count = 0, bytes = 0, peak = 0;
+    int nchunk = 0;
+    for (int i = 0; i < ALLOC_NKIND; i++) {
+        Arena *a = &arenas[i];
+        fprintf(stderr, "%-8s %10zu %12zu %12zu %8d\n",
+                kind_names[i], a->count, a->bytes, a->peak, a->nchunk);
+        count += a->count;
+        bytes += a->bytes;
+        peak += a->peak;
+        nchunk += a->nchunk;
+    }
+    fprintf(stderr, "%-8s %10zu %12zu %12zu %8d\n", "total", count, bytes, peak, nchunk);
+}
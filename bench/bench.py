@@ -0,0 +1,212 @@
+#!/usr/bin/python3
+# Copyright 2015 Rui Ueyama. Released under the MIT license.
+
+# This file is a compile-throughput benchmark.
+# It generates synthetic inputs that stress one part of the compiler
+# each, times plain compilations of them, and writes tokens/sec,
+# nodes/sec, bytes of assembly/sec and peak RSS for each to a JSON
+# file. The token and node counts come from one more compilation with
+# -ftime-report=json and -fmem-report, which is not timed because the
+# reports slow the compiler down. With --baseline, the results are
+# compared against an earlier run and regressions are reported.
+#
+# Usage: bench.py [--8cc path] [--scale n] [--repeat n] [--out file]
+#                 [--baseline file] [--threshold ratio]
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+def gen_macros(dir, n):
+    # A chain of 64 macros, each calling the one below, and a tower in
+    # which each level expands the one below twice. The tower's memory
+    # use grows fourfold per level, so it is kept low.
+    out = ["#define L0(x) (x)\n", "#define T0(x) ((x) + 1)\n"]
+    for d in range(1, 64):
+        out.append("#define L%d(x) (L%d(x) + %d)\n" % (d, d - 1, d))
+    for d in range(1, 6):
+        out.append("#define T%d(x) T%d(T%d(x))\n" % (d, d - 1, d - 1))
+    for i in range(n // 2):
+        out.append("int m%d(int a) { return L63(a) + T5(a); }\n" % i)
+    return out
+
+def gen_functions(dir, n):
+    out = []
+    for i in range(n * 4):
+        out.append("""int f%d(int a, int b) {
+    int s = 0;
+    for (int i = 0; i < a; i++) {
+        if (i & 1)
+            s += b * i;
+        else
+            s -= a ^ i;
+    }
+    while (s > b)
+        s = s / 2 - 1;
+    return s + %d;
+}
+""" % (i, i))
+    return out
+
+def gen_initializers(dir, n):
+    out = ["struct point { int x; int y; char tag; };\n"]
+    count = n * 64
+    out.append("int table[%d] = {\n" % count)
+    out.extend("    %d,\n" % (i * 7 % 32749) for i in range(count))
+    out.append("};\n")
+    out.append("struct point points[%d] = {\n" % (count // 4))
+    out.extend("    { %d, %d, 'a' },\n" % (i, -i) for i in range(count // 4))
+    out.append("};\n")
+    out.append("char *names[] = {\n")
+    out.extend('    "name%d",\n' % i for i in range(count // 16))
+    out.append("};\n")
+    return out
+
+def gen_switch(dir, n):
+    out = []
+    for f in range(max(n // 4, 1)):
+        out.append("int sw%d(int x) {\n    switch (x) {\n" % f)
+        out.extend("    case %d: return %d;\n" % (i * 3, i) for i in range(256))
+        out.append("    default: return -1;\n    }\n}\n")
+    return out
+
+def gen_includes(dir, n):
+    depth = n * 16
+    for i in range(depth):
+        with open(os.path.join(dir, "chain%d.h" % i), "w") as f:
+            f.write("#ifndef CHAIN%d_H\n#define CHAIN%d_H\n" % (i, i))
+            if i + 1 < depth:
+                f.write('#include "chain%d.h"\n' % (i + 1))
+            f.write("typedef struct s%d { int a; long b; } s%d;\n" % (i, i))
+            f.write("extern int v%d;\nint g%d(s%d *p);\n" % (i, i, i))
+            f.write("enum e%d { A%d, B%d, C%d };\n" % (i, i, i, i))
+            f.write("#define K%d %d\n#endif\n" % (i, i))
+    out = ['#include "chain0.h"\n'] * 2
+    out.append("int use(void) { return K0 + K%d + sizeof(s%d); }\n" % (depth - 1, depth - 1))
+    return out
+
+WORKLOADS = [
+    ("macros", gen_macros),
+    ("functions", gen_functions),
+    ("initializers", gen_initializers),
+    ("switch", gen_switch),
+    ("includes", gen_includes),
+]
+
+# Returns the time report and the node count from the stderr of 8cc.
+def parse_reports(stderr):
+    report, _, memtable = stderr.partition("\nkind ")
+    report = json.loads(report[report.index("{"):])
+    nodes = 0
+    for line in memtable.splitlines():
+        m = re.match(r"(node|global)\s+(\d+)", line)
+        if m:
+            nodes += int(m.group(2))
+    return report, nodes
+
+# Compiles src and returns the wall time, the rusage and the stderr.
+def compile(cc, dir, name, src, asm, flags=[]):
+    start = time.time()
+    p = subprocess.Popen([cc, "-S", "-w"] + flags + ["-o", asm, src],
+                         stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, cwd=dir,
+                         universal_newlines=True)
+    stderr = p.stderr.read()
+    _, status, rusage = os.wait4(p.pid, 0)
+    wall = time.time() - start
+    if status != 0:
+        sys.exit("%s: 8cc failed:\n%s" % (name, stderr))
+    return wall, rusage, stderr
+
+# Runs a workload, keeping the fastest of several runs to damp noise.
+def run(cc, dir, name, gen, scale, repeat):
+    src = os.path.join(dir, name + ".c")
+    asm = os.path.join(dir, name + ".s")
+    with open(src, "w") as f:
+        f.writelines(gen(dir, 256 * scale))
+    wall, rusage, _ = min((compile(cc, dir, name, src, asm) for i in range(repeat)),
+                          key=lambda r: r[0])
+    _, _, stderr = compile(cc, dir, name, src, asm, ["-ftime-report=json", "-fmem-report"])
+    report, nodes = parse_reports(stderr)
+    tokens = report["phases"]["lex"]["calls"]
+    size = os.path.getsize(asm)
+    return {
+        "seconds": wall,
+        "tokens": tokens,
+        "nodes": nodes,
+        "asm_bytes": size,
+        "tokens_per_sec": tokens / wall,
+        "nodes_per_sec": nodes / wall,
+        "asm_bytes_per_sec": size / wall,
+        "peak_rss_kb": rusage.ru_maxrss,
+        "phases_ms": {k: v["ms"] for k, v in report["phases"].items()},
+    }
+
+# Throughput metrics get worse as they fall, the others as they rise.
+METRICS = [
+    ("tokens_per_sec", False),
+    ("nodes_per_sec", False),
+    ("asm_bytes_per_sec", False),
+    ("peak_rss_kb", True),
+]
+
+# Workloads that take less than this many seconds are noisy, so they
+# are allowed twice the margin.
+SHORT_RUN = 0.5
+
+# Reports changes for the worse beyond threshold as regressions.
+def compare(results, baseline, threshold):
+    regressed = False
+    print("%-14s %-18s %14s %14s %8s" % ("workload", "metric", "baseline", "current", "ratio"))
+    for name, r in results.items():
+        b = baseline.get(name)
+        if not b:
+            continue
+        limit = threshold
+        if min(b["seconds"], r["seconds"]) < SHORT_RUN:
+            limit = 1 + (threshold - 1) * 2
+        for metric, lower_is_better in METRICS:
+            old, new = b[metric], r[metric]
+            ratio = new / old if old else 1.0
+            worse = ratio > limit if lower_is_better else ratio < 1 / limit
+            regressed |= worse
+            print("%-14s %-18s %14.0f %14.0f %7.2fx%s" %
+                  (name, metric, old, new, ratio, "  REGRESSION" if worse else ""))
+    return regressed
+
+def main():
+    parser = argparse.ArgumentParser(description="8cc compile-throughput benchmark")
+    parser.add_argument("--8cc", dest="cc", default="./8cc")
+    parser.add_argument("--scale", type=int, default=1)
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--out", default="bench/results.json")
+    parser.add_argument("--baseline")
+    parser.add_argument("--threshold", type=float, default=1.10)
+    args = parser.parse_args()
+    cc = os.path.abspath(args.cc)
+
+    results = {}
+    with tempfile.TemporaryDirectory() as dir:
+        for name, gen in WORKLOADS:
+            r = run(cc, dir, name, gen, args.scale, args.repeat)
+            results[name] = r
+            print("%-14s %8.3fs %10.0f tok/s %10.0f nodes/s %12.0f asm B/s %8d KB" %
+                  (name, r["seconds"], r["tokens_per_sec"], r["nodes_per_sec"],
+                   r["asm_bytes_per_sec"], r["peak_rss_kb"]))
+
+    with open(args.out, "w") as f:
+        json.dump({"scale": args.scale, "results": results}, f, indent=2, sort_keys=True)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        if baseline["scale"] != args.scale:
+            sys.exit("baseline was run with --scale %d" % baseline["scale"])
+        if compare(results, baseline["results"], args.threshold):
+            sys.exit(1)
+
+main()
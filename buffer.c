@@ -9,8 +9,8 @@
 #define INIT_SIZE 8
 
 Buffer *make_buffer() {
-    Buffer *r = malloc(sizeof(Buffer));
-    r->body = malloc(INIT_SIZE);
+    Buffer *r = alloc(ALLOC_BUFFER, sizeof(Buffer));
+    r->body = alloc(ALLOC_BUFFER, INIT_SIZE);
     r->nalloc = INIT_SIZE;
     r->len = 0;
     return r;
@@ -18,7 +18,7 @@ Buffer *make_buffer() {
 
 static void realloc_body(Buffer *b) {
     int newsize = b->nalloc * 2;
-    char *body = malloc(newsize);
+    char *body = alloc(ALLOC_BUFFER, newsize);
     memcpy(body, b->body, b->len);
     b->body = body;
     b->nalloc = newsize;
@@ -39,8 +39,10 @@ void buf_write(Buffer *b, char c) {
 }
 
 void buf_append(Buffer *b, char *s, int len) {
-    for (int i = 0; i < len; i++)
-        buf_write(b, s[i]);
+    while (b->nalloc <= b->len + len)
+        realloc_body(b);
+    memcpy(b->body + b->len, s, len);
+    b->len += len;
 }
 
 void buf_printf(Buffer *b, char *fmt, ...) {
@@ -6,6 +6,7 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <libgen.h>
 #include <locale.h>
 #include <stdlib.h>
@@ -15,9 +16,10 @@
 #include "8cc.h"
 
 static Map *macros = &EMPTY_MAP;
-static Map *once = &EMPTY_MAP;
 static Map *keywords = &EMPTY_MAP;
-static Map *include_guard = &EMPTY_MAP;
+static Map *headers = &EMPTY_MAP;
+static Map *header_names = &EMPTY_MAP;
+static Map *std_headers = &EMPTY_MAP;
 static Vector *cond_incl_stack = &EMPTY_VECTOR;
 static Vector *std_include_path = &EMPTY_VECTOR;
 static struct tm now;
@@ -35,6 +37,13 @@ typedef struct {
     bool wastrue;
 } CondIncl;
 
+// What is known about a header file that has been found
+typedef struct {
+    char *path;   // the shortest full path
+    char *guard;  // macro of the include guard, or NULL
+    bool once;    // #pragma once or #import
+} Header;
+
 typedef struct {
     MacroType kind;
     int nargs;
@@ -47,6 +56,7 @@ static Macro *make_obj_macro(Vector *body);
 static Macro *make_func_macro(Vector *body, int nargs, bool is_varg);
 static Macro *make_special_macro(SpecialMacroHandler *fn);
 static void define_obj_macro(char *name, Token *value);
+static Header *get_header(char *path);
 static void read_directive(Token *hash);
 static Token *read_expand(void);
 
@@ -55,16 +65,14 @@ static Token *read_expand(void);
  */
 
 static CondIncl *make_cond_incl(bool wastrue) {
-    CondIncl *r = calloc(1, sizeof(CondIncl));
+    CondIncl *r = alloc(ALLOC_OTHER, sizeof(CondIncl));
     r->ctx = IN_THEN;
     r->wastrue = wastrue;
     return r;
 }
 
 static Macro *make_macro(Macro *tmpl) {
-    Macro *r = malloc(sizeof(Macro));
-    *r = *tmpl;
-    return r;
+    return alloc_copy(ALLOC_MACRO, tmpl, sizeof(Macro));
 }
 
 static Macro *make_obj_macro(Vector *body) {
@@ -81,7 +89,7 @@ static Macro *make_special_macro(SpecialMacroHandler *fn) {
 }
 
 static Token *make_macro_token(int position, bool is_vararg) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = alloc(ALLOC_TOKEN, sizeof(Token));
     r->kind = TMACRO_PARAM;
     r->is_vararg = is_vararg;
     r->hideset = NULL;
@@ -92,9 +100,7 @@ static Token *make_macro_token(int position, bool is_vararg) {
 }
 
 static Token *copy_token(Token *tok) {
-    Token *r = malloc(sizeof(Token));
-    *r = *tok;
-    return r;
+    return alloc_copy(ALLOC_TOKEN, tok, sizeof(Token));
 }
 
 static void expect(char id) {
@@ -333,12 +339,15 @@ static Token *read_expand_newline() {
     if (!macro || set_has(tok->hideset, name))
         return tok;
 
+    long start = timereport ? time_now() : 0;
     switch (macro->kind) {
     case MACRO_OBJ: {
         Set *hideset = set_add(tok->hideset, name);
         Vector *tokens = subst(macro, NULL, hideset);
         propagate_space(tokens, tok);
         unget_all(tokens);
+        if (timereport)
+            record_macro_time(name, time_now() - start);
         return read_expand();
     }
     case MACRO_FUNC: {
@@ -351,6 +360,8 @@ static Token *read_expand_newline() {
         Vector *tokens = subst(macro, args, hideset);
         propagate_space(tokens, tok);
         unget_all(tokens);
+        if (timereport)
+            record_macro_time(name, time_now() - start);
         return read_expand();
     }
     case MACRO_SPECIAL:
@@ -599,7 +610,7 @@ static void read_endif(Token *hash) {
         return;
     Token *last = skip_newlines();
     if (ci->file != last->file)
-        map_put(include_guard, ci->file->name, ci->include_guard);
+        get_header(ci->file->name)->guard = ci->include_guard;
 }
 
 /*
@@ -668,47 +679,94 @@ static char *read_cpp_header_name(Token *hash, bool *std) {
     return join_paths(tokens);
 }
 
-static bool guarded(char *path) {
-    char *guard = map_get(include_guard, path);
-    bool r = (guard && map_get(macros, guard));
+/*
+ * Headers are cached by full path, and by the names that led to them,
+ * so that including a known header again neither searches the include
+ * path nor touches the file system unless the header is to be read.
+ *
+ * headers:      full path -> Header
+ * header_names: "dir/filename" as given to find_header -> Header,
+ *               or &no_header if there is no such file
+ * std_headers:  filename of #include <...> -> Header
+ *
+ * With the negative entries in header_names, each directory of the
+ * include path is asked for a file at most once per compilation.
+ */
+
+static Header no_header;
+
+static Header *get_header(char *path) {
+    Header *h = map_get(headers, path);
+    if (h)
+        return h;
+    h = alloc(ALLOC_OTHER, sizeof(Header));
+    h->path = path;
+    map_put(headers, path, h);
+    return h;
+}
+
+// Returns the header filename in dir, or NULL if there is no such file.
+static Header *find_header(char *dir, char *filename) {
+    char *name = format("%s/%s", dir, filename);
+    Header *h = map_get(header_names, name);
+    if (h)
+        return (h == &no_header) ? NULL : h;
+    char *path = fullpath(name);
+    h = map_get(headers, path);
+    if (!h && !access(path, R_OK))
+        h = get_header(path);
+    map_put(header_names, name, h ? h : &no_header);
+    return h;
+}
+
+// Returns the first header filename in the include path from i on.
+static Header *search_include_path(char *filename, int i) {
+    for (; i < vec_len(std_include_path); i++) {
+        Header *h = find_header(vec_get(std_include_path, i), filename);
+        if (h)
+            return h;
+    }
+    return NULL;
+}
+
+static bool guarded(Header *h) {
+    bool r = (h->guard && map_get(macros, h->guard));
     define_obj_macro("__8cc_include_guard", r ? cpp_token_one : cpp_token_zero);
     return r;
 }
 
-static bool try_include(char *dir, char *filename, bool isimport) {
-    char *path = fullpath(format("%s/%s", dir, filename));
-    if (map_get(once, path))
-        return true;
-    if (guarded(path))
-        return true;
-    FILE *fp = fopen(path, "r");
+static void include_header(Header *h, bool isimport) {
+    if (h->once || guarded(h))
+        return;
+    FILE *fp = fopen(h->path, "r");
     if (!fp)
-        return false;
+        error("cannot open %s: %s", h->path, strerror(errno));
     if (isimport)
-        map_put(once, path, (void *)1);
-    stream_push(make_file(fp, path));
-    return true;
+        h->once = true;
+    stream_push(make_file(fp, h->path));
 }
 
 static void read_include(Token *hash, File *file, bool isimport) {
     bool std;
     char *filename = read_cpp_header_name(hash, &std);
     expect_newline();
+    Header *h = NULL;
     if (filename[0] == '/') {
-        if (try_include("/", filename, isimport))
-            return;
-        goto err;
-    }
-    if (!std) {
-        char *dir = file->name ? dirname(strdup(file->name)) : ".";
-        if (try_include(dir, filename, isimport))
-            return;
+        h = find_header("/", filename);
+    } else {
+        if (!std) {
+            char *dir = file->name ? dirname(strdup(file->name)) : ".";
+            h = find_header(dir, filename);
+        }
+        if (!h) {
+            h = map_get(std_headers, filename);
+            if (!h && (h = search_include_path(filename, 0)))
+                map_put(std_headers, filename, h);
+        }
     }
-    for (int i = 0; i < vec_len(std_include_path); i++)
-        if (try_include(vec_get(std_include_path, i), filename, isimport))
-            return;
-  err:
-    errort(hash, "cannot find header file: %s", filename);
+    if (!h)
+        errort(hash, "cannot find header file: %s", filename);
+    include_header(h, isimport);
 }
 
 static void read_include_next(Token *hash, File *file) {
@@ -719,23 +777,22 @@ static void read_include_next(Token *hash, File *file) {
     bool std;
     char *filename = read_cpp_header_name(hash, &std);
     expect_newline();
+    Header *h = NULL;
     if (filename[0] == '/') {
-        if (try_include("/", filename, false))
-            return;
-        goto err;
-    }
-    char *cur = fullpath(file->name);
-    int i = 0;
-    for (; i < vec_len(std_include_path); i++) {
-        char *dir = vec_get(std_include_path, i);
-        if (!strcmp(cur, fullpath(format("%s/%s", dir, filename))))
-            break;
+        h = find_header("/", filename);
+    } else {
+        char *cur = fullpath(file->name);
+        int i = 0;
+        for (; i < vec_len(std_include_path); i++) {
+            Header *dup = find_header(vec_get(std_include_path, i), filename);
+            if (dup && !strcmp(cur, dup->path))
+                break;
+        }
+        h = search_include_path(filename, i + 1);
     }
-    for (i++; i < vec_len(std_include_path); i++)
-        if (try_include(vec_get(std_include_path, i), filename, false))
-            return;
-  err:
-    errort(hash, "cannot find header file: %s", filename);
+    if (!h)
+        errort(hash, "cannot find header file: %s", filename);
+    include_header(h, false);
 }
 
 /*
@@ -745,8 +802,7 @@ static void read_include_next(Token *hash, File *file) {
 static void parse_pragma_operand(Token *tok) {
     char *s = tok->sval;
     if (!strcmp(s, "once")) {
-        char *path = fullpath(tok->file->name);
-        map_put(once, path, (void *)1);
+        get_header(fullpath(tok->file->name))->once = true;
     } else if (!strcmp(s, "enable_warning")) {
         enable_warning = true;
     } else if (!strcmp(s, "disable_warning")) {
@@ -910,12 +966,85 @@ static void handle_include_level_macro(Token *tmpl) {
     make_token_pushback(tmpl, TNUMBER, format("%d", stream_depth() - 1));
 }
 
+/*
+ * Precompiled headers
+ */
+
+void write_cpp_state(Pch *p) {
+    Vector *names = map_keys(macros);
+    pch_put_int(p, vec_len(names));
+    for (int i = 0; i < vec_len(names); i++) {
+        char *name = vec_get(names, i);
+        Macro *m = map_get(macros, name);
+        pch_put_str(p, name);
+        pch_put_int(p, m->kind);
+        // Special macros are run by code, which is there after loading
+        if (m->kind == MACRO_SPECIAL)
+            continue;
+        pch_put_int(p, m->nargs);
+        pch_put_int(p, m->is_varg);
+        pch_put_int(p, vec_len(m->body));
+        for (int j = 0; j < vec_len(m->body); j++)
+            pch_put_token(p, vec_get(m->body, j));
+    }
+    Vector *paths = map_keys(headers);
+    pch_put_int(p, vec_len(paths));
+    for (int i = 0; i < vec_len(paths); i++) {
+        Header *h = map_get(headers, vec_get(paths, i));
+        pch_put_str(p, h->path);
+        pch_put_str(p, h->guard);
+        pch_put_int(p, h->once);
+    }
+}
+
+void read_cpp_state(Pch *p) {
+    Map *saved = make_map();
+    int nmacros = pch_get_int(p);
+    for (int i = 0; i < nmacros; i++) {
+        char *name = pch_get_atom(p);
+        MacroType kind = pch_get_int(p);
+        if (kind == MACRO_SPECIAL) {
+            Macro *m = map_get(macros, name);
+            if (m)
+                map_put(saved, name, m);
+            continue;
+        }
+        int nargs = pch_get_int(p);
+        bool is_varg = pch_get_int(p);
+        Vector *body = make_vector();
+        int len = pch_get_int(p);
+        for (int j = 0; j < len; j++)
+            vec_push(body, pch_get_token(p));
+        map_put(saved, name, (kind == MACRO_OBJ)
+                ? make_obj_macro(body)
+                : make_func_macro(body, nargs, is_varg));
+    }
+    macros = saved;
+    int nheaders = pch_get_int(p);
+    for (int i = 0; i < nheaders; i++) {
+        Header *h = get_header(pch_get_str(p));
+        h->guard = pch_get_str(p);
+        h->once = pch_get_int(p);
+    }
+}
+
 /*
  * Initializer
  */
 
+// Directories given by -I, which come before the standard ones
+static int nuser_include_path = 0;
+
 void add_include_path(char *path) {
-    vec_push(std_include_path, path);
+    // With 8cc --server, -I options are read after cpp_init.
+    vec_push(std_include_path, NULL);
+    for (int i = vec_len(std_include_path) - 1; i > nuser_include_path; i--)
+        vec_set(std_include_path, i, vec_get(std_include_path, i - 1));
+    vec_set(std_include_path, nuser_include_path++, path);
+}
+
+Vector *include_path() {
+    return std_include_path;
 }
 
 static void define_obj_macro(char *name, Token *value) {
@@ -927,8 +1056,8 @@ static void define_special_macro(char *name, SpecialMacroHandler *fn) {
 }
 
 static void init_keywords() {
-#define op(id, str)         map_put(keywords, str, (void *)id);
-#define keyword(id, str, _) map_put(keywords, str, (void *)id);
+#define op(id, str)         map_put(keywords, intern(str), (void *)id);
+#define keyword(id, str, _) map_put(keywords, intern(str), (void *)id);
 #include "keyword.inc"
 #undef keyword
 #undef op
@@ -1002,6 +1131,7 @@ Token *peek_token() {
 }
 
 Token *read_token() {
+    phase_enter(PHASE_CPP);
     Token *tok;
     for (;;) {
         tok = read_expand();
@@ -1010,6 +1140,7 @@ Token *read_token() {
             continue;
         }
         assert(tok->kind < MIN_CPP_TOKEN);
+        phase_exit();
         return maybe_convert_keyword(tok);
     }
 }
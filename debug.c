@@ -165,6 +165,17 @@ static void do_node2s(Buffer *b, Node *node) {
     case AST_GOTO:
         buf_printf(b, "goto(%s)", node->label);
         break;
+    case AST_SWITCH:
+        buf_printf(b, "(switch %s", node2s(node->switchexpr));
+        for (int i = 0; i < vec_len(node->switchcases); i++) {
+            Case *c = vec_get(node->switchcases, i);
+            if (c->beg == c->end)
+                buf_printf(b, " %d:%s", c->beg, c->label);
+            else
+                buf_printf(b, " %d...%d:%s", c->beg, c->end, c->label);
+        }
+        buf_printf(b, " default:%s)", node->switchdefault);
+        break;
     case AST_DECL:
         buf_printf(b, "(decl %s %s",
                    ty2s(node->declvar->ty),
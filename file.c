@@ -2,8 +2,8 @@
 
 /*
  * This file provides character input stream for C source code.
- * An input stream is either backed by stdio's FILE * or
- * backed by a string.
+ * An input stream is either backed by a file, which is read into
+ * memory at once, or backed by a string.
  * The following input processing is done at this stage.
  *
  * - C11 5.1.1.2p1: "\r\n" or "\r" are canonicalized to "\n".
@@ -13,9 +13,14 @@
  *   files end in a newline character (5.1.1.2p2). Thus, if all
  *   source files are comforming, this step wouldn't be needed.)
  *
+ * For files, the first and the last are done once for the whole
+ * buffer when the file is read. Backslash-newline is removed as
+ * characters are read, so that line numbers count the joined lines.
+ *
  * Trigraphs are not supported by design.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,12 +29,62 @@
 #include <unistd.h>
 #include "8cc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static Vector *files = &EMPTY_VECTOR;
 static Vector *stashed = &EMPTY_VECTOR;
+static Vector *opened = &EMPTY_VECTOR;  // every file read, in order
+
+/*
+ * Replaces "\r\n" and "\r" in s with "\n" and returns the new length.
+ * Most files have no "\r" at all, and memchr finds that quickly.
+ */
+static size_t canonicalize_newlines(char *s, size_t len) {
+    char *r = memchr(s, '\r', len);
+    if (!r)
+        return len;
+    char *w = r;
+    char *end = s + len;
+    while (r < end) {
+        char *cr = memchr(r, '\r', end - r);
+        size_t n = (cr ? cr : end) - r;
+        memmove(w, r, n);
+        w += n;
+        if (!cr)
+            break;
+        *w++ = '\n';
+        r = cr + 1;
+        if (r < end && *r == '\n')
+            r++;
+    }
+    return w - s;
+}
+
+/*
+ * Reads the rest of file into memory. size is a hint from fstat;
+ * it is 0 for pipes, whose size is not known in advance.
+ */
+static char *read_whole(FILE *file, size_t size, size_t *len) {
+    size_t cap = size + 2;
+    char *buf = malloc(cap);
+    size_t n = 0;
+    for (;;) {
+        n += fread(buf + n, 1, cap - n - 1, file);
+        if (n < cap - 1)
+            break;
+        cap *= 2;
+        buf = realloc(buf, cap);
+    }
+    if (ferror(file))
+        error("read failed: %s", strerror(errno));
+    *len = n;
+    return buf;
+}
 
 File *make_file(FILE *file, char *name) {
     File *r = calloc(1, sizeof(File));
-    r->file = file;
     r->name = name;
     r->line = 1;
     r->column = 1;
@@ -37,9 +92,29 @@ File *make_file(FILE *file, char *name) {
     if (fstat(fileno(file), &st) == -1)
         error("fstat failed: %s", strerror(errno));
     r->mtime = st.st_mtime;
+    r->mtime_ns = st.st_mtim.tv_nsec;
+    r->size = st.st_size;
+
+    phase_enter(PHASE_READ);
+    size_t len;
+    char *buf = read_whole(file, S_ISREG(st.st_mode) ? st.st_size : 0, &len);
+    fclose(file);
+    len = canonicalize_newlines(buf, len);
+    phase_exit();
+    if (len == 0 || buf[len - 1] != '\n')
+        buf[len++] = '\n';
+    r->data = buf;
+    r->p = buf;
+    r->end = buf + len;
+    vec_push(opened, r);
     return r;
 }
 
+// Returns the files read so far, which -fpch checks for changes.
+Vector *input_files() {
+    return opened;
+}
+
 File *make_file_string(char *s) {
     File *r = calloc(1, sizeof(File));
     r->line = 1;
@@ -49,22 +124,13 @@ File *make_file_string(char *s) {
 }
 
 static void close_file(File *f) {
-    if (f->file)
-        fclose(f->file);
+    free(f->data);
 }
 
 static int readc_file(File *f) {
-    int c = getc(f->file);
-    if (c == EOF) {
-        c = (f->last == '\n' || f->last == EOF) ? EOF : '\n';
-    } else if (c == '\r') {
-        int c2 = getc(f->file);
-        if (c2 != '\n')
-            ungetc(c2, f->file);
-        c = '\n';
-    }
-    f->last = c;
-    return c;
+    if (f->p == f->end)
+        return EOF;
+    return (unsigned char)*f->p++;
 }
 
 static int readc_string(File *f) {
@@ -88,7 +154,7 @@ static int get() {
     int c;
     if (f->buflen > 0) {
         c = f->buf[--f->buflen];
-    } else if (f->file) {
+    } else if (f->end) {
         c = readc_file(f);
     } else {
         c = readc_string(f);
@@ -135,6 +201,110 @@ void unreadc(int c) {
     }
 }
 
+/*
+ * Bulk scanning
+ *
+ * The lexer reads most characters in runs: identifiers, spaces and
+ * comment bodies. read_span() consumes such a run from the file buffer
+ * at once, 16 bytes at a time where SSE2 is available, instead of
+ * going through readc() for each character.
+ *
+ * A run never includes a backslash, so readc() is still the one that
+ * joins lines. Pushed-back characters and string-backed files are left
+ * to readc() too: read_span() consumes nothing for them.
+ */
+
+static bool span_char(int kind, unsigned char c) {
+    switch (kind) {
+    case SPAN_IDENT:
+        return isalnum(c) || c >= 0x80 || c == '_' || c == '$';
+    case SPAN_SPACE:
+        return c == ' ' || c == '\t' || c == '\f' || c == '\v';
+    case SPAN_LINE_COMMENT:
+        return c != '\n' && c != '\\';
+    case SPAN_BLOCK_COMMENT:
+        return c != '*' && c != '\\';
+    }
+    error("internal error: unknown span kind %d", kind);
+}
+
+#ifdef __SSE2__
+// Returns a mask of the bytes of v in [lo, hi].
+static __m128i in_range(__m128i v, char lo, char hi) {
+    // Unsigned comparison done with signed compare by shifting the range
+    __m128i t = _mm_add_epi8(v, _mm_set1_epi8((char)(-128 - lo)));
+    return _mm_cmplt_epi8(t, _mm_set1_epi8((char)(hi - lo - 127)));
+}
+
+// Returns a bit mask of the 16 bytes at p that end a span.
+static int span_stops(int kind, char *p) {
+    __m128i v = _mm_loadu_si128((__m128i *)p);
+    __m128i in;
+    switch (kind) {
+    case SPAN_IDENT:
+        in = _mm_or_si128(
+            _mm_or_si128(in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'),
+                         in_range(v, '0', '9')),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('$'))),
+                         _mm_cmplt_epi8(v, _mm_setzero_si128())));
+        break;
+    case SPAN_SPACE:
+        in = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                                       in_range(v, '\v', '\f')));
+        break;
+    default: {
+        char stop = (kind == SPAN_LINE_COMMENT) ? '\n' : '*';
+        __m128i out = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(stop)),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        return _mm_movemask_epi8(out);
+    }
+    }
+    return ~_mm_movemask_epi8(in) & 0xFFFF;
+}
+#endif
+
+// Returns the end of the run of the given kind that starts at p.
+static char *span_end(int kind, char *p, char *end) {
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16) {
+        int stops = span_stops(kind, p);
+        if (stops)
+            return p + __builtin_ctz(stops);
+    }
+#endif
+    while (p < end && span_char(kind, *p))
+        p++;
+    return p;
+}
+
+/*
+ * Consumes a run of characters of the given kind from the current file.
+ * Sets *start to the first of them and returns the length, which may be
+ * zero. Only block comment bodies can span lines.
+ */
+int read_span(int kind, char **start) {
+    File *f = vec_tail(files);
+    if (f->buflen > 0 || !f->end)
+        return 0;
+    char *p = f->p;
+    char *q = span_end(kind, p, f->end);
+    f->p = q;
+    *start = p;
+    if (kind != SPAN_BLOCK_COMMENT) {
+        f->column += q - p;
+        return q - p;
+    }
+    char *bol = p;
+    for (char *nl = memchr(p, '\n', q - p); nl; nl = memchr(nl + 1, '\n', q - nl - 1)) {
+        f->line++;
+        bol = nl + 1;
+    }
+    f->column = (bol == p) ? f->column + (q - p) : 1 + (q - bol);
+    return q - p;
+}
+
 File *current_file() {
     return vec_tail(files);
 }
@@ -0,0 +1,422 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+/*
+ * AST simplification
+ *
+ * The parser builds expression trees exactly as written, so code like
+ * "x * 1", "(a + 2) + 3" or "while (1)" reaches the code generator as
+ * arithmetic on constants. This pass rewrites each function body
+ * before it is emitted: operators whose operands are all integer
+ * literals are evaluated with the target's integer widths, literal
+ * additions are merged, identity operations are removed and if
+ * statements and ?: with a constant condition keep only the branch
+ * that is taken.
+ */
+
+#include "8cc.h"
+
+static Node *fold(Node *node);
+
+static bool is_intlit(Node *node) {
+    return node && node->kind == AST_LITERAL && is_inttype(node->ty)
+        && node->ty->size <= 4;
+}
+
+static bool is_foldable_type(Type *ty) {
+    return is_inttype(ty) && ty->size <= 4;
+}
+
+// Truncates v to the width of ty. Literals are kept zero-extended,
+// which is what the code generator expects.
+static long truncate_value(Type *ty, long v) {
+    if (ty->kind == KIND_BOOL)
+        return !!v;
+    if (ty->size >= (int)sizeof(long))
+        return v;
+    return v & ((1L << (ty->size * 8)) - 1);
+}
+
+// Converts v to ty as C does.
+static long convert_value(Type *ty, long v) {
+    v = truncate_value(ty, v);
+    int bits = ty->size * 8;
+    if (!ty->usig && ty->kind != KIND_BOOL && bits < (int)sizeof(long) * 8
+        && (v & (1L << (bits - 1))))
+        v -= 1L << bits;
+    return v;
+}
+
+// Returns the value of an integer literal as the C type sees it.
+static long lit_value(Node *node) {
+    return convert_value(node->ty, node->ival);
+}
+
+static Node *make_intlit(Node *orig, Type *ty, long v) {
+    Node *r = alloc(ALLOC_NODE, sizeof(Node));
+    *r = (Node){ AST_LITERAL, ty, orig->sourceLoc, .ival = truncate_value(ty, v) };
+    return r;
+}
+
+static bool same_type(Type *t, Type *u) {
+    return t->kind == u->kind && t->usig == u->usig && t->size == u->size;
+}
+
+static long all_ones(Type *ty) {
+    return truncate_value(ty, -1);
+}
+
+// True if the expression can be dropped without losing a side effect.
+// Globals and dereferences are excluded because they may be memory
+// mapped registers.
+static bool is_pure(Node *node) {
+    switch (node->kind) {
+    case AST_LITERAL:
+        return true;
+    case AST_LVAR:
+        return !node->lvarinit;
+    case AST_CONV: case OP_CAST: case '!': case '~':
+        return is_pure(node->operand);
+    case '+': case '-': case '*': case '&': case '|': case '^':
+    case '<': case OP_EQ: case OP_NE: case OP_LE:
+    case OP_SAL: case OP_SAR: case OP_SHR:
+    case OP_LOGAND: case OP_LOGOR:
+        return is_pure(node->left) && is_pure(node->right);
+    default:
+        return false;
+    }
+}
+
+static bool has_label(Node *node);
+
+static bool has_label_vector(Vector *v) {
+    for (int i = 0; i < vec_len(v); i++)
+        if (has_label(vec_get(v, i)))
+            return true;
+    return false;
+}
+
+// True if a label is defined somewhere in the statement. Such a branch
+// may be entered by goto or a case label and cannot be removed.
+static bool has_label(Node *node) {
+    if (!node)
+        return false;
+    switch (node->kind) {
+    case AST_LABEL:
+        return true;
+    case AST_COMPOUND_STMT:
+        return has_label_vector(node->stmts);
+    case AST_IF:
+    case AST_TERNARY:
+        return has_label(node->cond) || has_label(node->then) || has_label(node->els);
+    case AST_RETURN:
+        return has_label(node->retval);
+    case AST_CONV: case AST_ADDR: case AST_DEREF: case OP_CAST:
+    case '!': case '~': case AST_COMPUTED_GOTO:
+    case OP_PRE_INC: case OP_PRE_DEC: case OP_POST_INC: case OP_POST_DEC:
+        return has_label(node->operand);
+    case AST_STRUCT_REF:
+        return has_label(node->struc);
+    case AST_SWITCH:
+        return has_label(node->switchexpr);
+    case AST_FUNCPTR_CALL:
+        if (has_label(node->fptr))
+            return true;
+        // fallthrough
+    case AST_FUNCALL:
+        return has_label_vector(node->args);
+    case AST_DECL:
+        return node->declinit && has_label_vector(node->declinit);
+    case AST_INIT:
+        return has_label(node->initval);
+    case AST_LVAR: case AST_GVAR: case AST_LITERAL: case AST_TYPEDEF:
+    case AST_FUNCDESG: case AST_GOTO: case OP_LABEL_ADDR:
+        return false;
+    default:
+        return has_label(node->left) || has_label(node->right);
+    }
+}
+
+static Node *empty_stmt(void) {
+    Node *r = alloc(ALLOC_NODE, sizeof(Node));
+    *r = (Node){ AST_COMPOUND_STMT, .stmts = make_vector() };
+    return r;
+}
+
+static bool eval_binop(int op, Type *ty, long l, long r, long *val) {
+    int bits = ty->size * 8;
+    switch (op) {
+    // Wrap around as the target does, without signed overflow on the host
+    case '+': *val = convert_value(ty, (unsigned long)l + r); return true;
+    case '-': *val = convert_value(ty, (unsigned long)l - r); return true;
+    case '*': *val = convert_value(ty, (unsigned long)l * r); return true;
+    case '/':
+        if (r == 0)
+            return false;
+        *val = l / r;
+        return true;
+    case '%':
+        if (r == 0)
+            return false;
+        *val = l % r;
+        return true;
+    case '&': *val = l & r; return true;
+    case '|': *val = l | r; return true;
+    case '^': *val = l ^ r; return true;
+    case '<': *val = l < r; return true;
+    case OP_LE: *val = l <= r; return true;
+    case OP_EQ: *val = l == r; return true;
+    case OP_NE: *val = l != r; return true;
+    case OP_LOGAND: *val = l && r; return true;
+    case OP_LOGOR: *val = l || r; return true;
+    case OP_SAL: case OP_SAR: case OP_SHR:
+        if (r < 0 || r >= bits)
+            return false;
+        if (op == OP_SAL)
+            *val = (long)((unsigned long)l << r);
+        else if (op == OP_SAR)
+            *val = l >> r;
+        else
+            *val = (long)((unsigned long)truncate_value(ty, l) >> r);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_commutative(int op) {
+    switch (op) {
+    case '+': case '*': case '&': case '|': case '^':
+        return true;
+    default:
+        return false;
+    }
+}
+
+// (x op c1) op c2 => x op (c1 op c2), and the mixed +/- forms
+static Node *reassociate(Node *node) {
+    Node *inner = node->left;
+    int op = node->kind;
+    if (!is_intlit(node->right) || is_intlit(inner) || !same_type(inner->ty, node->ty))
+        return node;
+    if (!is_intlit(inner->right))
+        return node;
+    long c1 = lit_value(inner->right);
+    long c2 = lit_value(node->right);
+    bool additive = (op == '+' || op == '-') && (inner->kind == '+' || inner->kind == '-');
+    if (!additive && !(inner->kind == op && is_commutative(op)))
+        return node;
+    long c;
+    if (additive) {
+        // x + c1 + c2 is x + (c1 + c2), whatever the signs
+        if (inner->kind == '-')
+            c1 = -c1;
+        if (op == '-')
+            c2 = -c2;
+        c = c1 + c2;
+        op = '+';
+    } else if (!eval_binop(op, node->ty, c1, c2, &c)) {
+        return node;
+    }
+    Node *r = alloc(ALLOC_NODE, sizeof(Node));
+    *r = *node;
+    r->kind = op;
+    r->left = inner->left;
+    r->right = make_intlit(node->right, node->ty, c);
+    return r;
+}
+
+// x op identity => x, x op zero => zero
+static Node *simplify_identity(Node *node) {
+    Node *x = node->left;
+    if (!is_intlit(node->right) || !same_type(x->ty, node->ty))
+        return node;
+    long c = truncate_value(node->right->ty, node->right->ival);
+    switch (node->kind) {
+    case '+': case '-': case '|': case '^':
+    case OP_SAL: case OP_SAR: case OP_SHR:
+        return c == 0 ? x : node;
+    case '*':
+        if (c == 1)
+            return x;
+        if (c == 0 && is_pure(x))
+            return make_intlit(node, node->ty, 0);
+        return node;
+    case '/':
+        return c == 1 ? x : node;
+    case '%':
+        if (c == 1 && is_pure(x))
+            return make_intlit(node, node->ty, 0);
+        return node;
+    case '&':
+        if (c == all_ones(node->ty))
+            return x;
+        if (c == 0 && is_pure(x))
+            return make_intlit(node, node->ty, 0);
+        return node;
+    default:
+        return node;
+    }
+}
+
+static Node *fold_binop(Node *node) {
+    node->left = fold(node->left);
+    node->right = fold(node->right);
+    if (!is_foldable_type(node->ty))
+        return node;
+    Node *l = node->left;
+    Node *r = node->right;
+
+    // The right operand of && and || is not evaluated if the left one
+    // decides the result.
+    if (node->kind == OP_LOGAND && is_intlit(l) && !lit_value(l))
+        return make_intlit(node, node->ty, 0);
+    if (node->kind == OP_LOGOR && is_intlit(l) && lit_value(l))
+        return make_intlit(node, node->ty, 1);
+
+    if (is_intlit(l) && is_intlit(r)) {
+        long v;
+        if (eval_binop(node->kind, l->ty, lit_value(l), lit_value(r), &v))
+            return make_intlit(node, node->ty, v);
+        return node;
+    }
+
+    // Keep the literal on the right so that the rules below and the
+    // code generator see it as the immediate operand.
+    if (is_commutative(node->kind) && is_intlit(l)) {
+        node->left = r;
+        node->right = l;
+    }
+    node = reassociate(node);
+    return simplify_identity(node);
+}
+
+static Node *fold_uop(Node *node) {
+    node->operand = fold(node->operand);
+    Node *x = node->operand;
+    if (!is_intlit(x) || !is_foldable_type(node->ty))
+        return node;
+    switch (node->kind) {
+    case '!':
+        return make_intlit(node, node->ty, !lit_value(x));
+    case '~':
+        return make_intlit(node, node->ty, ~lit_value(x));
+    case AST_CONV:
+    case OP_CAST:
+        return make_intlit(node, node->ty, lit_value(x));
+    default:
+        return node;
+    }
+}
+
+static Node *fold_cond(Node *node) {
+    node->cond = fold(node->cond);
+    node->then = fold(node->then);
+    node->els = fold(node->els);
+    if (!is_intlit(node->cond))
+        return node;
+    bool taken = lit_value(node->cond) != 0;
+    Node *live = taken ? node->then : node->els;
+    Node *dead = taken ? node->els : node->then;
+    if (has_label(dead))
+        return node;
+    if (node->kind == AST_TERNARY) {
+        // [GNU] "c ?: x" yields c itself
+        if (!live)
+            return node;
+        return live;
+    }
+    return live ? live : empty_stmt();
+}
+
+// A switch on a constant jumps straight to its case.
+static Node *fold_switch(Node *node) {
+    node->switchexpr = fold(node->switchexpr);
+    Node *x = node->switchexpr;
+    if (!is_intlit(x))
+        return node;
+    long v = lit_value(x);
+    char *label = node->switchdefault;
+    for (int i = 0; i < vec_len(node->switchcases); i++) {
+        Case *c = vec_get(node->switchcases, i);
+        if (convert_value(x->ty, c->beg) <= v && v <= convert_value(x->ty, c->end))
+            label = c->label;
+    }
+    Node *r = alloc(ALLOC_NODE, sizeof(Node));
+    *r = (Node){ AST_GOTO, .sourceLoc = node->sourceLoc, .label = label, .newlabel = label };
+    return r;
+}
+
+static void fold_vector(Vector *v) {
+    for (int i = 0; i < vec_len(v); i++)
+        vec_set(v, i, fold(vec_get(v, i)));
+}
+
+static Node *fold(Node *node) {
+    if (!node)
+        return NULL;
+    switch (node->kind) {
+    case AST_LITERAL: case AST_GVAR: case AST_TYPEDEF: case AST_FUNCDESG:
+    case AST_GOTO: case AST_LABEL: case OP_LABEL_ADDR:
+        return node;
+    case AST_LVAR:
+        if (node->lvarinit)
+            fold_vector(node->lvarinit);
+        return node;
+    case AST_FUNCALL:
+        fold_vector(node->args);
+        return node;
+    case AST_FUNCPTR_CALL:
+        node->fptr = fold(node->fptr);
+        fold_vector(node->args);
+        return node;
+    case AST_FUNC:
+        node->body = fold(node->body);
+        return node;
+    case AST_DECL:
+        if (node->declinit)
+            fold_vector(node->declinit);
+        return node;
+    case AST_INIT:
+        node->initval = fold(node->initval);
+        return node;
+    case AST_IF:
+    case AST_TERNARY:
+        return fold_cond(node);
+    case AST_RETURN:
+        node->retval = fold(node->retval);
+        return node;
+    case AST_SWITCH:
+        return fold_switch(node);
+    case AST_COMPOUND_STMT:
+        fold_vector(node->stmts);
+        return node;
+    case AST_STRUCT_REF:
+        node->struc = fold(node->struc);
+        return node;
+    case AST_CONV: case OP_CAST: case '!': case '~':
+        return fold_uop(node);
+    case AST_ADDR: case AST_DEREF: case AST_COMPUTED_GOTO:
+    case OP_PRE_INC: case OP_PRE_DEC: case OP_POST_INC: case OP_POST_DEC:
+        node->operand = fold(node->operand);
+        return node;
+    case '=': case ',':
+        node->left = fold(node->left);
+        node->right = fold(node->right);
+        return node;
+    case '+': case '-': case '*': case '/': case '%':
+    case '&': case '|': case '^': case '<':
+    case OP_EQ: case OP_NE: case OP_LE:
+    case OP_SAL: case OP_SAR: case OP_SHR:
+    case OP_LOGAND: case OP_LOGOR:
+        return fold_binop(node);
+    default:
+        return node;
+    }
+}
+
+// Simplifies the body of a function definition in place. Global
+// initializers are left alone; gen.c evaluates them with eval_intexpr.
+void fold_toplevel(Node *v) {
+    if (v->kind == AST_FUNC)
+        fold(v);
+}
@@ -14,6 +14,7 @@
 static void emit_lsave(Type *ty, int off);
 static void ensure_lvar_init(Node *node);
 static void emit_label(const char *s);
+static void emit_cond_branch(Node *node, char *t, char *f);
 static void emit_pre_op(Node *node, char op);
 static void emit_post_op(Node *node, char op);
 static void do_emit_data(Vector *inits, int size, int off, int depth);
@@ -25,23 +26,225 @@ bool dumpsource = false;
 
 FILE *outputfd = NULL;
 
+/*
+ * Output
+ *
+ * Lines are collected in outbuf and written with a single fwrite per
+ * function, or when enough data lines have piled up. With
+ * -fdump-source, each line is preceded by a comment naming the line of
+ * gen.c that emitted it.
+ */
+
+#define OUTBUF_FLUSH (64 * 1024)
+
+static Buffer *outbuf;
+
 void set_output_file(FILE *fd) {
     outputfd = fd;
+    outbuf = make_buffer();
+}
+
+static void flush_output(void) {
+    fwrite(buf_body(outbuf), 1, buf_len(outbuf), outputfd);
+    outbuf->len = 0;
+}
+
+static void out(const char *s) {
+    buf_append(outbuf, (char *)s, strlen(s));
 }
 
+/* runtime helpers from libruntime used by this file */
+static Vector *runtime_syms = &EMPTY_VECTOR;
+
+static void print_cost_table(void);
+
 void close_output_file(void) {
+    print_cost_table();
+    for (int i = 0; i < vec_len(runtime_syms); i++) {
+        out(".global ");
+        out(vec_get(runtime_syms, i));
+        out("\n");
+    }
+    flush_output();
     fclose(outputfd);
 }
 
+bool peepopt = true;
+bool costreport = false;
+
+/* lines of the function being emitted, NULL outside of functions */
+static Vector *funcbuf = NULL;
+
+/* Appends v in the given base, padded with pad to at least width digits. */
+static void out_uint(Buffer *b, unsigned long v, int base, int width, char pad) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+    for (; width > n; width--)
+        buf_write(b, pad);
+    while (n > 0)
+        buf_write(b, digits[--n]);
+}
+
+static void write_line(unsigned int line, const char *text) {
+    if (dumpsource) {
+        out("; gen.c:");
+        out_uint(outbuf, line, 10, 0, ' ');
+        out("\n");
+    }
+    out(text);
+    out("\n");
+    if (!funcbuf && buf_len(outbuf) >= OUTBUF_FLUSH)
+        flush_output();
+}
+
+/*
+ * Formats a line of assembly. gen.c uses only a few conversions, which
+ * are expanded here rather than by vsnprintf: %s, %c, and %d, %u and
+ * %x with an optional zero-padded width. Anything else goes to
+ * vformat. Lines without conversions are used as they are.
+ */
+static char *format_line(const char *fmt, va_list ap) {
+    if (!strchr(fmt, '%'))
+        return (char *)fmt;
+    static Buffer *b;
+    if (!b)
+        b = make_buffer();
+    b->len = 0;
+    va_list aq;
+    va_copy(aq, ap);
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%') {
+            buf_write(b, *p);
+            continue;
+        }
+        const char *spec = p + 1;
+        char pad = ' ';
+        if (*spec == '0') {
+            pad = '0';
+            spec++;
+        }
+        int width = 0;
+        for (; '0' <= *spec && *spec <= '9'; spec++)
+            width = width * 10 + *spec - '0';
+        switch (*spec) {
+        case 's': {
+            char *s = va_arg(aq, char *);
+            for (int len = strlen(s); width > len; width--)
+                buf_write(b, ' ');
+            buf_append(b, s, strlen(s));
+            break;
+        }
+        case 'c':
+            buf_write(b, va_arg(aq, int));
+            break;
+        case 'd': {
+            int v = va_arg(aq, int);
+            if (v < 0) {
+                buf_write(b, '-');
+                width--;
+            }
+            out_uint(b, v < 0 ? -(unsigned)v : (unsigned)v, 10, width, pad);
+            break;
+        }
+        case 'u':
+            out_uint(b, va_arg(aq, unsigned), 10, width, pad);
+            break;
+        case 'x':
+            out_uint(b, va_arg(aq, unsigned), 16, width, pad);
+            break;
+        case '%':
+            buf_write(b, '%');
+            break;
+        default:
+            va_end(aq);
+            return vformat((char *)fmt, ap);
+        }
+        p = spec;
+    }
+    va_end(aq);
+    buf_write(b, '\0');
+    return alloc_copy(ALLOC_BUFFER, buf_body(b), buf_len(b));
+}
+
 static void emit_line(unsigned int line, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
+    char *text = format_line(fmt, args);
+    va_end(args);
 
-    fprintf(outputfd, "; gen.c:%u\n", line);
+    if (funcbuf)
+        vec_push(funcbuf, make_insn(line, text));
+    else
+        write_line(line, text);
+}
 
-    vfprintf(outputfd, fmt, args);
+/* per function lines of the -fcost-report table */
+static Vector *cost_table = NULL;
+static int total_bytes = 0;
+static int total_cycles = 0;
+
+/*
+ * Annotates each instruction of buf with its size and cycles, and
+ * writes the totals of the function in front of it. Cycles are a
+ * static estimate: every instruction is counted once, and branches
+ * are counted as taken.
+ */
+static void annotate_costs(Vector *buf, char *fname) {
+    bool m8 = false, x8 = false, code = true;
+    int bytes = 0, cycles = 0;
+    for (int i = 0; i < vec_len(buf); i++) {
+        Insn *p = vec_get(buf, i);
+        if (p->kind == INSN_MODE) {
+            if (!strcmp(p->op, ".a8") || !strcmp(p->op, ".a16"))
+                m8 = !strcmp(p->op, ".a8");
+            else
+                x8 = !strcmp(p->op, ".i8");
+            continue;
+        }
+        if (p->kind == INSN_OTHER && !strncmp(p->text, ".segment", 8))
+            code = strstr(p->text, "\"C_CODE\"") != NULL;
+        if (!code || p->kind != INSN_OP)
+            continue;
+        int b, c;
+        insn_cost(p, m8, x8, &b, &c);
+        p->text = format("%s\t; %d bytes, %d cycles", p->text, b, c);
+        bytes += b;
+        cycles += c;
+    }
+    write_line(__LINE__, format("; %s: %d bytes, %d cycles", fname, bytes, cycles));
+    if (!cost_table)
+        cost_table = make_vector();
+    vec_push(cost_table, format("%-24s %8d %8d", fname, bytes, cycles));
+    total_bytes += bytes;
+    total_cycles += cycles;
+}
 
-    fprintf(outputfd, "\n");
+static void print_cost_table(void) {
+    if (!cost_table)
+        return;
+    fprintf(stderr, "%-24s %8s %8s\n", "function", "bytes", "cycles");
+    for (int i = 0; i < vec_len(cost_table); i++)
+        fprintf(stderr, "%s\n", (char *)vec_get(cost_table, i));
+    fprintf(stderr, "%-24s %8d %8d\n", "total", total_bytes, total_cycles);
+}
+
+static void flush_func(char *fname) {
+    Vector *buf = funcbuf;
+    funcbuf = NULL;
+    if (peepopt)
+        peephole(buf);
+    relax_branches(buf);
+    if (costreport)
+        annotate_costs(buf, fname);
+    for (int i = 0; i < vec_len(buf); i++) {
+        Insn *p = vec_get(buf, i);
+        write_line(p->line, p->text);
+    }
+    flush_output();
 }
 
 #define emit(...) (emit_line(__LINE__, "\t" __VA_ARGS__))
@@ -49,6 +252,64 @@ static void emit_line(unsigned int line, const char *fmt, ...) {
 
 static int stackpos = 0;
 
+/*
+ * Direct page layout
+ *
+ *   $00-$0F  scratch for inline sequences and runtime helpers
+ *   $10-$1F  expression temporaries (see save_tmp)
+ *   $20-$21  frame pointer, -fdp-frame only
+ *
+ * Without -fdp-frame D stays 0 and these are shared by all functions.
+ * With it, every function gets a private copy at the bottom of its
+ * frame and addresses locals relative to D as well.
+ */
+
+#define DP_PTR 0x04
+#define DP_TMP_BASE 0x10
+#define DP_TMP_SLOTS 8
+#define DP_FRAME_PTR 0x20
+#define DP_SCRATCH_SIZE 0x22
+
+bool dpframe = false;
+static int framepos = 0; /* stackpos at the time D was set up */
+
+/* true if the local at off can be addressed with an 8-bit offset */
+static bool frame_near(int off) {
+    int d = dpframe ? framepos - off : 1 + stackpos - off;
+    return 0 <= d && d <= 0xFF;
+}
+
+/*
+ * Emits insn on the frame slot at off (as in Node.loff). Slots out
+ * of reach of an 8-bit offset go through the frame pointer, which
+ * clobbers Y.
+ */
+static void emit_frame_insn(const char *insn, int off) {
+    if (!dpframe) {
+        if (!frame_near(off))
+            error("stack frame too large, try -fdp-frame");
+        emit("%s $%02X,S", insn, 1 + stackpos - off);
+    } else if (frame_near(off)) {
+        emit("%s $%02X", insn, framepos - off);
+    } else {
+        emit("ldy #$%04X", framepos - off);
+        emit("%s ($%02X),Y", insn, DP_FRAME_PTR);
+    }
+}
+
+/* A = address of the frame slot at off */
+static void emit_frame_addr(int off) {
+    if (dpframe) {
+        emit("tdc");
+        emit("clc");
+        emit("adc #$%04x", framepos - off);
+    } else {
+        emit("tsc");
+        emit("clc");
+        emit("adc #$%04x", 1 + stackpos - off);
+    }
+}
+
 static void emit_text_segment(void) {
     emit_noident(".segment \"C_CODE\":far");
 }
@@ -98,9 +359,7 @@ void emit_lload(Type *ty, int off) {
 
     if (ty->kind == KIND_ARRAY) {
         /* see emit_addr */
-        emit("tsc");
-        emit("clc");
-        emit("adc #$%04x", (1 + stackpos - off));
+        emit_frame_addr(off);
     } else if (ty->kind == KIND_FLOAT) {
         assert(0);
     } else if (ty->kind == KIND_DOUBLE || ty->kind == KIND_LDOUBLE) {
@@ -108,16 +367,17 @@ void emit_lload(Type *ty, int off) {
     } else {
         switch (ty->size) {
             case 1:
-                emit("lda $%02x,S", 1 + stackpos - off);
-                break;
             case 2:
-                emit("; off = %d (stackpos = %u)", off, stackpos);
-                emit("lda $%02x,S", 1 + stackpos - off);
+                emit_frame_insn("lda", off);
                 break;
             case 4:
-                emit("lda $%02x,S", 1 + stackpos - off + 1);
-                emit("tax");
-                emit("lda $%02x,S", 1 + stackpos - off);
+                if (dpframe && frame_near(off - 2)) {
+                    emit_frame_insn("ldx", off - 2);
+                } else {
+                    emit_frame_insn("lda", off - 2);
+                    emit("tax");
+                }
+                emit_frame_insn("lda", off);
                 break;
             default:
                 assert(0);
@@ -130,9 +390,23 @@ void emit_lvar(Node *node) {
     emit_lload(node->ty, node->loff);
 }
 
-/* TODO: for large num there's better ways */
+/*
+ * Up to this many bytes are dropped with ply, beyond that it is cheaper
+ * to adjust S directly (8 bytes and 13 cycles including saving A).
+ */
+#define PLY_CLEANUP_MAX 6
+
+/* drop num bytes from the stack, keeping A and X */
 static void emit_stack_cleanup(size_t num) {
-    assert(num <= 10 * 1024); /* FIXME: remove, but there's probably something fisshy about a call like this */
+    if (num > PLY_CLEANUP_MAX) {
+        emit("tay");
+        emit("tsc");
+        emit("clc");
+        emit("adc #$%04x", num);
+        emit("tcs");
+        emit("tya");
+        return;
+    }
 
     if (num % 2 != 0) {
         emit("phb");
@@ -144,9 +418,43 @@ static void emit_stack_cleanup(size_t num) {
     }
 }
 
+/* reserve num bytes on the stack, clobbers A */
+static void emit_stack_alloc(size_t num) {
+    if (num > PLY_CLEANUP_MAX) {
+        emit("tsc");
+        emit("sec");
+        emit("sbc #$%04x", num);
+        emit("tcs");
+        return;
+    }
+
+    if (num % 2 != 0) {
+        emit("phb");
+    }
+
+    for (size_t i = 0; i < num / 2; i++) {
+        emit("phx");
+    }
+}
+
+/* label of the shared epilogue and the stack depth it expects */
+static char *retlabel;
+static int retpos;
+
 /* cleanup stack and emit return instruction */
-void emit_ret(void) {
-    emit_stack_cleanup(stackpos);
+static void emit_ret(void) {
+    if (dpframe) {
+        /* S = D + framepos - 3 points just below the saved D */
+        emit("tay");
+        emit("tdc");
+        emit("clc");
+        emit("adc #$%04x", framepos - 3);
+        emit("tcs");
+        emit("tya");
+        emit("pld");
+    } else {
+        emit_stack_cleanup(stackpos);
+    }
     emit("rtl");
 }
 
@@ -156,7 +464,17 @@ static void emit_return(Node *node) {
         // maybe_booleanize_retval(node->retval->ty);
     }
 
-    emit_ret();
+    /* an epilogue no bigger than the jump to it is not worth sharing */
+    if (!dpframe && stackpos <= 4) {
+        emit_ret();
+        return;
+    }
+
+    /* a return inside a statement expression may leave extra bytes */
+    if (!dpframe && stackpos != retpos) {
+        emit_stack_cleanup(stackpos - retpos);
+    }
+    emit("jmp f:%s", retlabel);
 }
 
 static void emit_intcast(Type *from) {
@@ -241,17 +559,31 @@ static void emit_save_literal(Node *node, Type *totype, int off) {
     switch(totype->kind) {
         case KIND_BOOL:
         case KIND_CHAR:
+            emit("lda #$%04x", node->ival & 0xFF);
+            emit_lsave(totype, off);
+            break;
         case KIND_SHORT:
-            assert(0);
         case KIND_INT:
         case KIND_PTR:
-            emit("tay");
-            emit("lda #$%04x", node->ival);
-            assert(off <= stackpos);
-            emit("sta $%02X,S", 1 + stackpos - off);
-            emit("tya");
+            if (frame_near(off)) {
+                emit("tay");
+                emit("lda #$%04x", node->ival);
+                emit_frame_insn("sta", off);
+                emit("tya");
+            } else {
+                emit("pha");
+                stackpos += 2;
+                emit("lda #$%04x", node->ival);
+                emit_frame_insn("sta", off);
+                emit("pla");
+                stackpos -= 2;
+            }
             break;
         case KIND_LONG:
+            emit("lda #$%04x", node->ival & 0xFFFF);
+            emit("ldx #$%04x", (node->ival >> 16) & 0xFFFF);
+            emit_lsave(totype, off);
+            break;
         case KIND_LLONG:
             assert(0);
         case KIND_FLOAT:
@@ -263,12 +595,13 @@ static void emit_save_literal(Node *node, Type *totype, int off) {
     }
 }
 
-static void emit_zero_filler(size_t start, size_t end) {
+/* zeroes bytes [start, end) of the local at off */
+static void emit_zero_filler(int off, size_t start, size_t end) {
     assert((end - start) % 2 == 0); // TODO: implement
     if ((end - start) > 0) {
         emit("lda #$0000");
         for (;start <= end - 2; start += 2) {
-            emit("sta $%02X,S", start);
+            emit_frame_insn("sta", off - start);
         }
     }
 }
@@ -293,13 +626,13 @@ static void emit_fill_holes(Vector *inits, int off, int totalsize) {
     for (size_t i = 0; i < len; i++) {
         Node *node = buf[i];
         if (lastend < node->initoff) {
-            emit_zero_filler(lastend + off, node->initoff + off);
+            emit_zero_filler(off, lastend, node->initoff);
         }
 
         lastend = node->initoff + node->totype->size;
     }
 
-    emit_zero_filler(lastend + off, totalsize + off);
+    emit_zero_filler(off, lastend, totalsize);
 }
 
 static void emit_decl_init(Vector *inits, int off, int totalsize) {
@@ -311,10 +644,10 @@ static void emit_decl_init(Vector *inits, int off, int totalsize) {
 
         bool isbitfield = (node->totype->bitsize > 0);
         if (node->initval->kind == AST_LITERAL && !isbitfield) {
-            emit_save_literal(node->initval, node->totype, node->initoff + off);
+            emit_save_literal(node->initval, node->totype, off - node->initoff);
         } else {
             emit_expr(node->initval);
-            emit_lsave(node->totype, node->initoff + off);
+            emit_lsave(node->totype, off - node->initoff);
         }
     }
 }
@@ -336,109 +669,406 @@ static void emit_decl(Node *node) {
     }
 }
 
+/*
+ * Expression temporaries
+ *
+ * A binary operator needs its right-hand side somewhere addressable
+ * while the left-hand side is computed in A. Literals, locals and
+ * globals are used in place as memory operands. Anything else is
+ * parked in a direct-page scratch slot, or pushed on the hardware
+ * stack if the other operand may call a function (the callee is free
+ * to reuse the scratch area) or all slots are taken.
+ */
+
+enum {
+    TMP_NONE = -2,  /* leaf operand, nothing to release */
+    TMP_STACK = -1, /* pushed with pha */
+};
+
+bool dptemps = true;
+static int tmp_used = 0; /* bitmask of busy direct-page slots */
+
+/* true if evaluating node may jsl somewhere */
+static bool has_call(Node *node) {
+    if (!node)
+        return false;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+            return false;
+        case AST_LVAR:
+            return node->lvarinit != NULL;
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            return has_call(node->operand);
+        case AST_STRUCT_REF:
+            return has_call(node->struc);
+        case AST_IF:
+        case AST_TERNARY:
+            return has_call(node->cond) || has_call(node->then) || has_call(node->els);
+        case '+': case '-': case '*': case '/': case '%':
+        case '&': case '|': case '^': case '<': case '=': case ',':
+        case OP_EQ: case OP_NE: case OP_LE:
+        case OP_SAL: case OP_SAR: case OP_SHR:
+        case OP_LOGAND: case OP_LOGOR:
+            return has_call(node->left) || has_call(node->right);
+        default:
+            return true;
+    }
+}
+
+/* returns an operand addressing node in place, or NULL */
+static char *leaf_operand(Node *node) {
+    if (node->ty->size != 2 || node->ty->kind == KIND_ARRAY)
+        return NULL;
+    switch (node->kind) {
+        case AST_LITERAL:
+            return format("#$%04X", node->ival & 0xFFFF);
+        case AST_LVAR:
+            if (node->lvarinit || !frame_near(node->loff))
+                return NULL;
+            if (dpframe)
+                return format("$%02X", framepos - node->loff);
+            return format("$%02X,S", 1 + stackpos - node->loff);
+        case AST_GVAR:
+            return format("a:%s", node->glabel);
+        default:
+            return NULL;
+    }
+}
+
+/* parks A until release_tmp; next is the expression evaluated meanwhile */
+static int save_tmp(Node *next) {
+    if (dptemps && !has_call(next)) {
+        for (int i = 0; i < DP_TMP_SLOTS; i++) {
+            if (tmp_used & (1 << i))
+                continue;
+            tmp_used |= 1 << i;
+            emit("sta $%02X", DP_TMP_BASE + i * 2);
+            return i;
+        }
+    }
+    emit("pha");
+    stackpos += 2;
+    return TMP_STACK;
+}
+
+static char *tmp_operand(int slot) {
+    assert(slot != TMP_NONE);
+    if (slot == TMP_STACK)
+        return "$1,S";
+    return format("$%02X", DP_TMP_BASE + slot * 2);
+}
+
+static void release_tmp(int slot) {
+    if (slot == TMP_NONE)
+        return;
+    if (slot == TMP_STACK) {
+        emit("ply");
+        stackpos -= 2;
+        return;
+    }
+    tmp_used &= ~(1 << slot);
+}
+
+/*
+ * Loads acc into A and returns an operand addressing mem; the
+ * operand stays valid until release_tmp(*slot). If commutative,
+ * the two sides may be swapped to avoid a temporary.
+ */
+static char *emit_operands(Node *acc, Node *mem, bool commutative, int *slot) {
+    *slot = TMP_NONE;
+    if (leaf_operand(mem)) {
+        emit_expr(acc);
+        return leaf_operand(mem);
+    }
+    if (commutative && leaf_operand(acc)) {
+        emit_expr(mem);
+        return leaf_operand(acc);
+    }
+    emit_expr(mem);
+    *slot = save_tmp(acc);
+    emit_expr(acc);
+    return tmp_operand(*slot);
+}
+
+/* A = left <insn> right, e.g. "adc" after "clc" */
+static void emit_binop_insn(Node *node, char *pre, char *insn, bool commutative) {
+    assert(node->left->ty->size == 2);
+    assert(node->right->ty->size == 2);
+    int slot;
+    char *op = emit_operands(node->left, node->right, commutative, &slot);
+    if (pre)
+        emit("%s", pre);
+    emit("%s %s", insn, op);
+    release_tmp(slot);
+}
+
+static void use_runtime_sym(char *name) {
+    for (int i = 0; i < vec_len(runtime_syms); i++)
+        if (!strcmp(vec_get(runtime_syms, i), name))
+            return;
+    vec_push(runtime_syms, name);
+}
+
+static void emit_runtime_call(char *name) {
+    use_runtime_sym(name);
+    emit("jsl %s", name);
+}
+
+/* X = op, keeps A */
+static void emit_ldx(char *op) {
+    int len = strlen(op);
+    if (len > 2 && !strcmp(op + len - 2, ",S")) {
+        /* no stack relative ldx */
+        emit("tay");
+        emit("lda %s", op);
+        emit("tax");
+        emit("tya");
+    } else {
+        emit("ldx %s", op);
+    }
+}
+
+static void emit_shl(int n) {
+    if (n >= 16) {
+        emit("lda #$0000");
+        return;
+    }
+    if (n >= 8) {
+        emit("xba");
+        emit("and #$ff00");
+        n -= 8;
+    }
+    for (; n > 0; n--)
+        emit("asl");
+}
+
+static void emit_shr(int n) {
+    if (n >= 16) {
+        emit("lda #$0000");
+        return;
+    }
+    if (n >= 8) {
+        emit("xba");
+        emit("and #$00ff");
+        n -= 8;
+    }
+    for (; n > 0; n--)
+        emit("lsr");
+}
+
+/* log2(c) if c is a power of two, else -1 */
+static int log2_exact(unsigned c) {
+    if (c == 0 || (c & (c - 1)))
+        return -1;
+    int n = 0;
+    while (c >>= 1)
+        n++;
+    return n;
+}
+
+/*
+ * A = x * c using shifts and at most one add or subtract, for c of
+ * the form 2^a, 2^a + 2^b or 2^a - 2^b. Returns false if c is not.
+ */
+static bool emit_mul_const(Node *x, unsigned c) {
+    c &= 0xFFFF;
+    bool neg = c > 0x8000;
+    if (neg)
+        c = 0x10000 - c;
+
+    int a, b;
+    char *pre, *insn;
+    if (c == 0 || log2_exact(c) >= 0) {
+        a = b = -1;
+        pre = insn = NULL;
+    } else if (log2_exact(c & -c) >= 0 && log2_exact(c - (c & -c)) >= 0) {
+        /* 2^a + 2^b */
+        b = log2_exact(c & -c);
+        a = log2_exact(c - (c & -c));
+        pre = "clc";
+        insn = "adc";
+    } else if (log2_exact(c + (c & -c)) >= 0) {
+        /* 2^a - 2^b */
+        b = log2_exact(c & -c);
+        a = log2_exact(c + (c & -c));
+        pre = "sec";
+        insn = "sbc";
+    } else {
+        return false;
+    }
+
+    emit_expr(x);
+    if (c == 0) {
+        emit("lda #$0000");
+    } else if (!insn) {
+        emit_shl(log2_exact(c));
+    } else {
+        emit_shl(b);
+        emit("sta $00");
+        emit_shl(a - b);
+        emit("%s", pre);
+        emit("%s $00", insn);
+    }
+    if (neg) {
+        emit("eor #$ffff");
+        emit("inc");
+    }
+    return true;
+}
+
+static void emit_mul(Node *node) {
+    assert(node->left->ty->size == 2);
+    assert(node->right->ty->size == 2);
+    if (node->right->kind == AST_LITERAL && emit_mul_const(node->left, node->right->ival))
+        return;
+    if (node->left->kind == AST_LITERAL && emit_mul_const(node->right, node->left->ival))
+        return;
+
+    int slot;
+    char *op = emit_operands(node->left, node->right, true, &slot);
+    emit_ldx(op);
+    release_tmp(slot);
+    emit_runtime_call("__mul16");
+}
+
+/*
+ * A = x / c or x % c for a power of two c. Signed remainders are
+ * left to the runtime. Returns false if c is not handled.
+ */
+static bool emit_div_const(Node *node, unsigned c) {
+    c &= 0xFFFF;
+    int n = log2_exact(c);
+    bool usig = node->ty->usig;
+    if (n < 0 || (!usig && (node->kind == '%' || n == 15)))
+        return false;
+
+    emit_expr(node->left);
+    if (node->kind == '%') {
+        emit("and #$%04x", c - 1);
+    } else if (usig) {
+        emit_shr(n);
+    } else if (n > 0) {
+        /* round towards zero: bias negative dividends by c - 1 */
+        char *l = make_label();
+        emit("cmp #$8000");
+        emit("bcc %s", l);
+        emit("clc");
+        emit("adc #$%04x", c - 1);
+        emit_label(l);
+        for (int i = 0; i < n; i++) {
+            emit("cmp #$8000");
+            emit("ror a");
+        }
+    }
+    return true;
+}
+
+static void emit_div(Node *node) {
+    assert(node->left->ty->size == 2);
+    assert(node->right->ty->size == 2);
+    if (node->right->kind == AST_LITERAL && emit_div_const(node, node->right->ival))
+        return;
+
+    int slot;
+    char *op = emit_operands(node->left, node->right, false, &slot);
+    emit_ldx(op);
+    release_tmp(slot);
+    emit_runtime_call(node->ty->usig ? "__divmod16" : "__sdivmod16");
+    if (node->kind == '%')
+        emit("txa");
+}
+
+/* X:A = (left pulled from the stack) <insn> X:A, word by word */
+static void emit_long_insn(char *pre, char *insn) {
+    emit("sta $00");
+    emit("stx $02");
+    emit("pla");
+    if (pre)
+        emit("%s", pre);
+    emit("%s $00", insn);
+    emit("tay");
+    emit("pla");
+    emit("%s $02", insn);
+    emit("tax");
+    emit("tya");
+    stackpos -= 4;
+}
+
+/*
+ * 32 bit operators. Left is pushed while right is computed, multiply
+ * and divide pass it on to the runtime that way.
+ */
+static void emit_binop_long(Node *node) {
+    assert(node->left->ty->size == 4);
+    assert(node->right->ty->size == 4);
+    emit_expr(node->left);
+    emit("phx");
+    emit("pha");
+    stackpos += 4;
+    emit_expr(node->right);
+    switch (node->kind) {
+        case '+': emit_long_insn("clc", "adc"); return;
+        case '-': emit_long_insn("sec", "sbc"); return;
+        case '&': emit_long_insn(NULL, "and"); return;
+        case '|': emit_long_insn(NULL, "ora"); return;
+        case '^': emit_long_insn(NULL, "eor"); return;
+    }
+    switch (node->kind) {
+        case '*':
+            emit_runtime_call("__mul32");
+            break;
+        case '/':
+        case '%':
+            emit_runtime_call(node->ty->usig ? "__div32" : "__sdiv32");
+            if (node->kind == '%') {
+                /* remainder is left in the direct page */
+                emit("lda $08");
+                emit("ldx $0A");
+            }
+            break;
+        default:
+            error("internal error: 32 bit %s is not supported", node2s(node));
+    }
+    emit_stack_cleanup(4);
+    stackpos -= 4;
+}
+
 void emit_binop_int(Node *node) {
+    if (node->ty->size == 4) {
+        emit_binop_long(node);
+        return;
+    }
+
     switch (node->kind) {
         case '+':
-            assert(node->left->ty->size == 2);
-            assert(node->right->ty->size == 2);
-            if (node->left->kind == AST_LITERAL) {
-                emit_expr(node->right);
-                emit("clc");
-                emit("adc #$%04X", node->left->ival);
-            } else if (node->right->kind == AST_LITERAL) {
-                emit_expr(node->left);
-                emit("clc");
-                emit("adc #$%04X", node->right->ival);
-            } else {
-                emit_expr(node->left);
-                emit("pha");
-                stackpos += 2;
-                size_t stackpos_saved = stackpos;
-                emit_expr(node->right);
-                assert(stackpos_saved == stackpos);
-                emit("clc");
-                emit("adc $1,S");
-                emit("ply");
-                stackpos -= 2;
-            }
+            emit_binop_insn(node, "clc", "adc", true);
             break;
         case '-':
-            assert(node->left->ty->size == 2);
-            assert(node->right->ty->size == 2);
-            if (node->right->kind == AST_LITERAL) {
-                emit_expr(node->left);
-                emit("sec");
-                emit("sbc #$%0X", node->right->ival);
-            } else {
-                emit_expr(node->right);
-                emit("pha");
-                stackpos += 2;
-                emit_expr(node->left);
-                emit("sec");
-                emit("sbc $1,S");
-                emit("ply");
-                stackpos -= 2;
-            }
+            emit_binop_insn(node, "sec", "sbc", false);
             break;
         case '*':
-            assert(node->left->ty->size == 2);
-            assert(node->right->ty->size == 2);
-            {
-                emit_expr(node->left);
-                emit("pha");
-                stackpos += 2;
-                emit_expr(node->right);
-                emit("sta $00"); /* operand 1*/
-                emit("pla");
-                stackpos -= 2;
-                emit("sta $02"); /* operand 2*/
-
-                emit("lda #$0000"); /* result */
-
-                const char * const mult1 = make_label();
-                const char * const mult2 = make_label();
-                const char * const done = make_label();
-
-                emit_label(mult1);
-                emit("ldx $00"); /* operand 1 */
-                emit("beq %s", done);
-                emit("lsr $00");
-                emit("bcc %s", mult2);
-                emit("clc");
-                emit("adc $02"); /* operand 2 */
-                emit_label(mult2);
-                emit("asl $02"); /* operand 2 */
-                emit("bra %s", mult1);
-                emit_label(done);
-            }
+            emit_mul(node);
             break;
         case '^':
-            assert(node->left->ty->size == 2);
-            assert(node->right->ty->size == 2);
-            if (node->right->kind == AST_LITERAL) {
-                emit_expr(node->left);
-                emit("eor #$%04x", node->right->ival);
-            } else if (node->left->kind == AST_LITERAL) {
-                emit_expr(node->right);
-                emit("eor #$%04x", node->left->ival);
-            } else {
-                emit_expr(node->left);
-                emit("pha");
-                stackpos += 2;
-                emit_expr(node->right);
-                emit("eor $1,S");
-                emit("ply");
-                stackpos -= 2;
-            }
+            emit_binop_insn(node, NULL, "eor", true);
             break;
         case OP_SAL: // ASL
             assert(node->left->ty->size == 2);
             assert(node->right->ty->size == 2);
             if (node->right->kind == AST_LITERAL) {
                 emit_expr(node->left);
-                for (size_t i = 0; i < node->right->ival; i++) {
-                    emit("asl");
-                }
+                emit_shl(node->right->ival);
             } else {
                 assert(0);
             }
@@ -450,71 +1080,14 @@ void emit_binop_int(Node *node) {
             assert(node->right->ty->size == 2);
             if (node->right->kind == AST_LITERAL) {
                 emit_expr(node->left);
-                for (size_t i = 0; i < node->right->ival; i++) {
-                    emit("lsr");
-                }
+                emit_shr(node->right->ival);
             } else {
                 assert(0);
             }
             break;
         case '/':
         case '%':
-            assert(node->left->ty->size == 2);
-            assert(node->right->ty->size == 2);
-            {
-                /* source: http://archive.6502.org/datasheets/wdc_65816_programming_manual.pdf */
-                const char *div1 = make_label();
-                const char *div2 = make_label();
-                const char *div3 = make_label();
-                const char *div4 = make_label();
-
-                emit_expr(node->left);
-                emit("tax");
-
-                emit("phx");
-                stackpos += 2;
-
-                emit_expr(node->right);
-
-                emit("plx");
-                stackpos -= 2;
-
-                /* Y = shift count
-                 * $00 -> result
-                 * A -> remainder */
-                emit("ldy #$0001");
-                emit("stz $00"); /* result */
-
-
-                emit_label(div1);
-                emit("asl a");
-                emit("bcs %s", div2);
-                emit("iny");
-                emit("cpy #17");
-                emit("bne %s", div1);
-                emit_label(div2);
-                emit("ror a");
-                emit_label(div4);
-                emit("pha");
-                emit("txa");
-                emit("sec");
-                emit("sbc $1,S");
-                emit("bcc %s", div3);
-                emit("tax");
-                emit_label(div3);
-                emit("rol $00"); /* result */
-                emit("pla");
-                emit("lsr a");
-                emit("dey");
-                emit("bne %s", div4);
-            }
-
-            if (node->kind == '%') {
-                emit("txa");
-            } else {
-                emit("lda $00");
-            }
-
+            emit_div(node);
             break;
         default:
             printf("node->kind = %u\n", node->kind);
@@ -529,20 +1102,24 @@ static void emit_lsave(Type *ty, int off) {
         case KIND_SHORT:
             emit("sep #$20");
             emit(".a8");
-            emit("sta $%02X,S", 1 + stackpos - off);
+            emit_frame_insn("sta", off);
             emit("rep #$20");
             emit(".a16");
             break;
         case KIND_INT:
         case KIND_PTR:
-            emit("sta $%02X,S", 1 + stackpos - off);
+            emit_frame_insn("sta", off);
             break;
         case KIND_LONG:
-            emit("sta $%02X,S", 1 + stackpos - off);
+            emit_frame_insn("sta", off);
+            if (dpframe && frame_near(off - 2)) {
+                emit_frame_insn("stx", off - 2);
+                break;
+            }
             emit("pha");
             stackpos += 2;
             emit("txa");
-            emit("sta $%02X,S", 1 + stackpos - off + 2);
+            emit_frame_insn("sta", off - 2);
             emit("pla");
             stackpos -= 2;
             break;
@@ -582,20 +1159,23 @@ static void emit_gsave(const char *label, Type *ty, int off) {
     }
 }
 
-/* FIXME: wrong, assumes too many things, will break */
+/* *(A + off) = value pushed by the caller */
 static void do_emit_assign_deref(Type *ty, int off) {
     assert((ty->size == 2) || (ty->size == 1));
 
-    emit("pha");
-    stackpos += 2;
-
-    emit("lda $3,S");
+    emit("sta $%02X", DP_PTR);
+    emit("pla");
+    stackpos -= 2;
     emit("ldy #$%04x", off);
-    emit("sta ($1,S),Y");
-
-    emit("ply");
-    emit("ply");
-    stackpos -= 4;
+    if (ty->size == 1) {
+        emit("sep #$20");
+        emit(".a8");
+        emit("sta ($%02X),Y", DP_PTR);
+        emit("rep #$20");
+        emit(".a16");
+    } else {
+        emit("sta ($%02X),Y", DP_PTR);
+    }
 }
 
 static void emit_assign_struct_ref(Node *struc, Type *field, int off) {
@@ -626,8 +1206,7 @@ static void emit_assign_deref(Node *node) {
     emit("pha");
     stackpos += 2;
     emit_expr(node->operand);
-    // assert(node->operand->ty->ptr->size == 2);
-    do_emit_assign_deref(node->operand->ty, 0);
+    do_emit_assign_deref(node->operand->ty->ptr, 0);
 }
 
 static void emit_store(Node *node) {
@@ -706,8 +1285,9 @@ static void emit_func_call(Node *node) {
                 emit("pha");
                 stackpos += 2;
             } else if (v->ty->size == 4) {
-                emit("pha");
+                /* high word first, so that the long is little endian */
                 emit("phx");
+                emit("pha");
                 stackpos += 4;
             } else {
                 assert(0);
@@ -718,11 +1298,14 @@ static void emit_func_call(Node *node) {
     if (is_ptr_call) {
         emit_expr(node->fptr);
 
-        /* we manually encode a jmp long instruction at $00 */
+        /*
+         * we manually encode a jmp long instruction at $00:0000, absolute
+         * addressing so that this also works with D != 0
+         */
         emit("ldy #$005C");
-        emit("sty $0000");
-        emit("sta $0001");
-        emit("stx $0003");
+        emit("sty a:$0000");
+        emit("sta a:$0001");
+        emit("stx a:$0003");
 
         emit("jsl $000000");
     } else {
@@ -747,27 +1330,23 @@ static void emit_deref_a(Type *ty, size_t size, size_t off) {
     } else if ((ty->kind == KIND_DOUBLE) || (ty->kind == KIND_LDOUBLE)) {
         assert(0);
     } else {
-        emit("pha");
-        stackpos += 2;
+        emit("sta $%02X", DP_PTR);
 
         switch(size) {
             case 1:
                 /* fall-through */
             case 2:
                 emit("ldy #$%04x", off);
-                emit("lda ($1,S),Y");
+                emit("lda ($%02X),Y", DP_PTR);
                 break;
-            case 3:
-                emit("ldy #$%04x", off + 1);
-                emit("lda ($1,S),Y");
+            case 4:
+                emit("ldy #$%04x", off + 2);
+                emit("lda ($%02X),Y", DP_PTR);
                 emit("tax");
-                emit("dey");
-                emit("lda ($1,S),Y");
+                emit("ldy #$%04x", off);
+                emit("lda ($%02X),Y", DP_PTR);
                 break;
         }
-
-        emit("ply");
-        stackpos -= 2;
     }
 }
 
@@ -779,9 +1358,7 @@ static void emit_deref(Node *node) {
 }
 
 static void emit_pointer_arith(char kind, Node *left, Node *right) {
-    emit_expr(left);
-    emit("pha");
-    stackpos += 2;
+    /* the scaled index is never a leaf, so it always gets a temporary */
     emit_expr(right);
 
     int size = left->ty->ptr->size;
@@ -792,17 +1369,19 @@ static void emit_pointer_arith(char kind, Node *left, Node *right) {
         }
     }
 
+    int slot = save_tmp(left);
+    emit_expr(left);
+
     /* 16-bit arithmatic */
     if (kind == '+') {
         emit("clc");
-        emit("adc $1,S");
+        emit("adc %s", tmp_operand(slot));
     } else if (kind == '-') {
         emit("sec");
-        emit("sbc $1,S");
+        emit("sbc %s", tmp_operand(slot));
     }
 
-    emit("ply");
-    stackpos -= 2;
+    release_tmp(slot);
 }
 
 /* ++X / --X */
@@ -882,10 +1461,28 @@ static void emit_post_op(Node *node, char op) {
 }
 
 static void emit_ternary(Node *node) {
-    emit_expr(node->cond);
-    const char *ne = make_label();
-    emit("cmp #$0000");
-    emit("beq %s", ne);
+    /* "if (c) goto L" with either branch empty, as loops are lowered */
+    Node *jump = node->then ? node->then : node->els;
+    if (node->kind == AST_IF && !(node->then && node->els) && jump && jump->kind == AST_GOTO) {
+        char *skip = make_label();
+        if (node->then)
+            emit_cond_branch(node->cond, NULL, skip);
+        else
+            emit_cond_branch(node->cond, skip, NULL);
+        emit("jmp f:%s", jump->newlabel);
+        emit_label(skip);
+        return;
+    }
+
+    char *ne = make_label();
+    if (node->then || node->kind == AST_IF) {
+        emit_cond_branch(node->cond, NULL, ne);
+    } else {
+        /* [GNU] "c ?: x" yields c itself */
+        emit_expr(node->cond);
+        emit("cmp #$0000");
+        emit("beq %s", ne);
+    }
 
     if (node->then) {
         emit_expr(node->then);
@@ -902,146 +1499,322 @@ static void emit_ternary(Node *node) {
     }
 }
 
-/* FIXME: this is inefficient ... */
-/* left == right */
-static void emit_cmp_eq(Node *node) {
-    assert(node->left->ty->size == 2);
-    assert(node->right->ty->size == 2);
-    emit_expr(node->left);
-    emit("pha");
-    stackpos += 2;
-    emit_expr(node->right);
-    emit("cmp $1,S");
-
-    const char *cmp_true = make_label();
-    const char *cmp_cont = make_label();
-    emit("beq %s", cmp_true);
-    emit("lda #$0000"); /* false */
-    emit("bra %s", cmp_cont);
-    emit_noident("%s:", cmp_true);
-    emit("lda #$0001"); /* true */
-    emit_noident("%s:", cmp_cont);
-
-    emit("ply");
-    stackpos -= 2;
+/*
+ * Switch dispatch
+ *
+ * The controlling value is in A. Cases are compared as unsigned
+ * 16-bit numbers; a signed value is biased by $8000 first so the same
+ * compares order it correctly. A dense run of cases becomes an
+ * indexed jump through a table of labels. Otherwise the cases are
+ * split in half by a compare until few enough are left to test one
+ * by one.
+ */
+
+#define SWITCH_TABLE_MIN 4      /* fewest cases worth a jump table */
+#define SWITCH_TABLE_MAX 256    /* most entries in one jump table */
+#define SWITCH_TABLE_DENSITY 3  /* at most this many entries per case */
+#define SWITCH_LINEAR_MAX 3     /* cases tested one by one */
+
+/* jump tables of the switch being emitted, as label/entries pairs */
+static Vector *switch_tables;
+
+static int case_compare(const void *a, const void *b) {
+    const Case *x = *(Case **)a;
+    const Case *y = *(Case **)b;
+    return (x->beg > y->beg) - (x->beg < y->beg);
 }
 
-/* FIXME: see above */
-/* left != right */
-static void emit_cmp_ne(Node *node) {
-    printf("%s: node->left->ty->size = %u\n", __func__, node->left->ty->size);
-    assert(node->left->ty->size == node->right->ty->size);
-
-    if (node->left->ty->size == 2) {
-        emit_expr(node->left);
-        emit("pha");
-        stackpos += 2;
-        emit_expr(node->right);
-        emit("cmp $1,S");
-
-        const char *cmp_false = make_label();
-        const char *cmp_cont = make_label();
-        emit("beq %s", cmp_false);
-        emit("lda #$0001"); /* true */
-        emit("bra %s", cmp_cont);
-        emit_noident("%s:", cmp_false);
-        emit("lda #$0000"); /* false */
-        emit_noident("%s:", cmp_cont);
-
-        emit("ply");
-        stackpos -= 2;
-    } else if (node->left->ty->size == 4) {
-        const char * const bool_false = make_label();
-        const char * const bool_end = make_label();
-
-        emit_expr(node->left);
-        emit("pha");
-        emit("phx");
-        stackpos += 4;
-
-        emit_expr(node->right);
-
-        emit("cmp $3,S");
-        emit("beq %s", bool_false);
-        emit("txa");
-        emit("cmp $1,S");
-        emit("beq %s", bool_false);
-
-        emit("lda #$0001"); /* true */
-        emit("bra %s", bool_end);
-        emit_label(bool_false);
-        emit("lda #$0000");
-        emit_label(bool_end);
+static bool is_dense(Vector *cases, int lo, int hi) {
+    if (hi - lo < SWITCH_TABLE_MIN)
+        return false;
+    Case *first = vec_get(cases, lo);
+    Case *last = vec_get(cases, hi - 1);
+    int span = last->end - first->beg + 1;
+    return span <= SWITCH_TABLE_MAX && span <= (hi - lo) * SWITCH_TABLE_DENSITY;
+}
 
-        emit("ply");
-        emit("ply");
-        stackpos -= 4;
+/* A is known to be in [min, max] */
+static void emit_case_test(Case *c, int min, int max) {
+    char *next = make_label();
+    if (c->beg == c->end) {
+        emit("cmp #$%04X", c->beg);
+        emit("bne %s", next);
     } else {
-        assert(0);
+        if (c->beg > min) {
+            emit("cmp #$%04X", c->beg);
+            emit("bcc %s", next);
+        }
+        if (c->end < max) {
+            emit("cmp #$%04X", c->end + 1);
+            emit("bcs %s", next);
+        }
     }
-
+    emit("jmp f:%s", c->label);
+    emit_label(next);
 }
 
-/* FIXME: see above */
-/* left < right */
-static void emit_cmp_lt(Node *node) {
-    assert(node->left->ty->size == node->right->ty->size);
-    assert(node->left->ty->size == 2);
-    assert(node->right->ty->size == 2);
-    assert(node->left->ty->usig);
-    assert(node->right->ty->usig);
-
-    emit_expr(node->right);
-    emit("pha");
-    stackpos += 2;
+static void emit_jump_table(Vector *cases, int lo, int hi, int min, int max, char *deflabel) {
+    Case *first = vec_get(cases, lo);
+    Case *last = vec_get(cases, hi - 1);
+    if (first->beg > 0) {
+        emit("sec");
+        emit("sbc #$%04X", first->beg);
+    }
+    if (first->beg > min || last->end < max) {
+        char *ok = make_label();
+        emit("cmp #$%04X", last->end - first->beg + 1);
+        emit("bcc %s", ok);
+        emit("jmp f:%s", deflabel);
+        emit_label(ok);
+    }
+    char *table = make_label();
+    emit("asl a");
+    emit("tax");
+    emit("jmp (%s,x)", table);
+
+    Vector *entries = make_vector();
+    int v = first->beg;
+    for (int i = lo; i < hi; i++) {
+        Case *c = vec_get(cases, i);
+        for (; v < c->beg; v++)
+            vec_push(entries, deflabel);
+        for (; v <= c->end; v++)
+            vec_push(entries, c->label);
+    }
+    vec_push(switch_tables, make_pair(table, entries));
+}
 
-    emit_expr(node->left);
-    emit("cmp $1,S");
+static void emit_case_tree(Vector *cases, int lo, int hi, int min, int max, char *deflabel) {
+    if (is_dense(cases, lo, hi)) {
+        emit_jump_table(cases, lo, hi, min, max, deflabel);
+        return;
+    }
+    if (hi - lo <= SWITCH_LINEAR_MAX) {
+        for (int i = lo; i < hi; i++)
+            emit_case_test(vec_get(cases, i), min, max);
+        emit("jmp f:%s", deflabel);
+        return;
+    }
+    int mid = lo + (hi - lo) / 2;
+    Case *pivot = vec_get(cases, mid);
+    char *right = make_label();
+    emit("cmp #$%04X", pivot->beg);
+    if (mid - lo <= SWITCH_LINEAR_MAX || is_dense(cases, lo, mid)) {
+        /* the left half is short enough for a relative branch */
+        emit("bcs %s", right);
+    } else {
+        char *left = make_label();
+        emit("bcc %s", left);
+        emit("jmp f:%s", right);
+        emit_label(left);
+    }
+    emit_case_tree(cases, lo, mid, min, pivot->beg - 1, deflabel);
+    emit_label(right);
+    emit_case_tree(cases, mid, hi, pivot->beg, max, deflabel);
+}
 
-    const char * const bool_true = make_label();
-    const char * const bool_end = make_label();
+static void emit_switch(Node *node) {
+    assert(node->switchexpr->ty->size == 2);
+    emit_expr(node->switchexpr);
+
+    /* the case values as compared against A */
+    int bias = node->switchexpr->ty->usig ? 0 : 0x8000;
+    if (bias)
+        emit("eor #$%04X", bias);
+    Vector *cases = make_vector();
+    for (int i = 0; i < vec_len(node->switchcases); i++) {
+        Case *c = vec_get(node->switchcases, i);
+        Case *r = alloc(ALLOC_OTHER, sizeof(Case));
+        r->beg = (c->beg & 0xFFFF) ^ bias;
+        r->end = (c->end & 0xFFFF) ^ bias;
+        r->label = c->label;
+        if (r->beg <= r->end)
+            vec_push(cases, r);
+    }
+    qsort(vec_body(cases), vec_len(cases), sizeof(void *), case_compare);
+
+    switch_tables = make_vector();
+    emit_case_tree(cases, 0, vec_len(cases), 0, 0xFFFF, node->switchdefault);
+    for (int i = 0; i < vec_len(switch_tables); i++) {
+        void **p = vec_get(switch_tables, i);
+        Vector *entries = p[1];
+        emit_label(p[0]);
+        for (int j = 0; j < vec_len(entries); j += 8) {
+            Buffer *b = make_buffer();
+            for (int k = j; k < j + 8 && k < vec_len(entries); k++)
+                buf_printf(b, "%s%s", k == j ? "" : ", ", vec_get(entries, k));
+            emit(".addr %s", buf_body(b));
+        }
+    }
+}
 
-    emit("bcc %s", bool_true); /* blt branch if less than */
-    emit("lda #$0000");
-    emit("bra %s", bool_end);
-    emit_label(bool_true);
-    emit("lda #$0001");
-    emit_label(bool_end);
+/*
+ * Conditions
+ *
+ * A condition is compiled into branches rather than a 0/1 value.
+ * emit_cond_branch jumps to t if node is true and to f if it is false;
+ * either label may be NULL to fall through instead. Comparisons set the
+ * flags with cmp or sbc and branch on them directly, and && and ||
+ * short-circuit into the same labels.
+ */
+
+/* op is the branch taken when the condition holds */
+static void emit_branch(char *op, char *t, char *f) {
+    if (t) {
+        emit("%s %s", op, t);
+        if (f)
+            emit("bra %s", f);
+    } else if (f) {
+        emit("%s %s", invert_branch(op), f);
+    }
+}
 
-    emit("ply");
-    stackpos -= 2;
+static bool is_unsigned_cmp(Type *ty) {
+    return ty->usig || ty->kind == KIND_PTR;
 }
 
-/* FIXME: see above */
-/* left <= right */
-static void emit_cmp_le(Node *node) {
-    assert(node->left->ty->size == node->right->ty->size);
-    assert(node->left->ty->size == 2);
-    assert(node->right->ty->size == 2);
-    assert(node->left->ty->usig);
-    assert(node->right->ty->usig);
+/* N xor V is the sign of the result after sbc; fold it into N */
+static void emit_signed_fixup(void) {
+    char *l = make_label();
+    emit("bvc %s", l);
+    emit("eor #$8000");
+    emit_label(l);
+}
 
-    emit_expr(node->right);
+/*
+ * Compares left and right for kind OP_EQ or '<' and returns the
+ * branch that is taken if the comparison holds.
+ */
+static char *emit_compare_long(int kind, Node *left, Node *right) {
+    emit_expr(left);
+    emit("phx");
     emit("pha");
-    stackpos += 2;
-
-    emit_expr(node->left);
-    emit("cmp $1,S");
+    stackpos += 4;
+    emit_expr(right);
+    emit("sta $00");
+    emit("stx $02");
+    emit("pla");
+    emit("sec");
+    emit("sbc $00");
+    if (kind == OP_EQ) {
+        emit("sta $00");
+        emit("pla");
+        emit("sbc $02");
+        stackpos -= 4;
+        emit("ora $00");
+        return "beq";
+    }
+    emit("pla");
+    emit("sbc $02");
+    stackpos -= 4;
+    if (is_unsigned_cmp(left->ty))
+        return "bcc";
+    emit_signed_fixup();
+    return "bmi";
+}
 
-    const char * const bool_true = make_label();
-    const char * const bool_end = make_label();
+static char *emit_compare(int kind, Node *left, Node *right) {
+    assert(left->ty->size == right->ty->size);
+    if (left->ty->size == 4)
+        return emit_compare_long(kind, left, right);
+    assert(left->ty->size == 2);
+
+    /* ply releasing a stack temporary clobbers N and Z, but not C */
+    int slot;
+    char *op = emit_operands(left, right, kind == OP_EQ, &slot);
+    if (kind == OP_EQ) {
+        if (slot != TMP_STACK) {
+            emit("cmp %s", op);
+            release_tmp(slot);
+            return "beq";
+        }
+        emit("sec");
+        emit("sbc %s", op);
+        release_tmp(slot);
+        emit("cmp #$0001");
+        return "bcc";
+    }
+    if (is_unsigned_cmp(left->ty)) {
+        emit("cmp %s", op);
+        release_tmp(slot);
+        return "bcc";
+    }
+    emit("sec");
+    emit("sbc %s", op);
+    emit_signed_fixup();
+    if (slot != TMP_STACK) {
+        release_tmp(slot);
+        return "bmi";
+    }
+    release_tmp(slot);
+    emit("asl a");
+    return "bcs";
+}
 
-    emit("bcc %s", bool_true); /* blt branch if less than */
-    emit("beq %s", bool_true); /**/
+static void emit_cond_branch(Node *node, char *t, char *f) {
+    switch (node->kind) {
+        case AST_LITERAL:
+            if (is_inttype(node->ty)) {
+                char *l = node->ival ? t : f;
+                if (l)
+                    emit("bra %s", l);
+                return;
+            }
+            break;
+        case '!':
+            emit_cond_branch(node->operand, f, t);
+            return;
+        case OP_LOGAND: {
+            char *skip = f ? NULL : make_label();
+            emit_cond_branch(node->left, NULL, f ? f : skip);
+            emit_cond_branch(node->right, t, f);
+            if (skip)
+                emit_label(skip);
+            return;
+        }
+        case OP_LOGOR: {
+            char *skip = t ? NULL : make_label();
+            emit_cond_branch(node->left, t ? t : skip, NULL);
+            emit_cond_branch(node->right, t, f);
+            if (skip)
+                emit_label(skip);
+            return;
+        }
+        case OP_EQ:
+            emit_branch(emit_compare(OP_EQ, node->left, node->right), t, f);
+            return;
+        case OP_NE:
+            emit_branch(emit_compare(OP_EQ, node->left, node->right), f, t);
+            return;
+        case '<':
+            emit_branch(emit_compare('<', node->left, node->right), t, f);
+            return;
+        case OP_LE:
+            /* a <= b is !(b < a) */
+            emit_branch(emit_compare('<', node->right, node->left), f, t);
+            return;
+    }
+    assert(!is_flotype(node->ty));
+    emit_expr(node);
+    if (node->ty->size == 4) {
+        emit("stx $00");
+        emit("ora $00");
+    } else {
+        emit("cmp #$0000");
+    }
+    emit_branch("bne", t, f);
+}
 
-    emit("lda #$0000");
-    emit("bra %s", bool_end);
-    emit_label(bool_true);
+/* A = node ? 1 : 0 */
+static void emit_bool(Node *node) {
+    char *f = make_label();
+    char *end = make_label();
+    emit_cond_branch(node, NULL, f);
     emit("lda #$0001");
-    emit_label(bool_end);
-
-    emit("ply");
-    stackpos -= 2;
+    emit("bra %s", end);
+    emit_label(f);
+    emit("lda #$0000");
+    emit_label(end);
 }
 
 static void emit_load_struct_ref(Node *struc, Type *field, int off) {
@@ -1069,10 +1842,7 @@ static void emit_addr(Node *node) {
     switch (node->kind) {
         case AST_LVAR:
             ensure_lvar_init(node);
-            emit("tsc");
-            /* see emit_lload: lda [1 + stackpos - node->loff],S */
-            emit("clc");
-            emit("adc #$%04x", (1 + stackpos - node->loff));
+            emit_frame_addr(node->loff);
             break;
         case AST_GVAR:
             emit("lda #%s", node->glabel);
@@ -1094,85 +1864,21 @@ static void emit_addr(Node *node) {
 }
 
 static void emit_binop_bitor(Node *node) {
-    printf("node->ty->size = %u\n", node->ty->size);
-    printf("node->ty->kind = %u\n", node->ty->kind);
+    if (node->ty->size == 4) {
+        emit_binop_long(node);
+        return;
+    }
     assert(node->ty->size == 2);
-    assert(node->left->ty->size == 2);
-    assert(node->right->ty->size == 2);
-    emit_expr(node->left);
-    emit("pha");
-    stackpos += 2;
-    emit_expr(node->right);
-    emit("ora $1,S");
-    emit("ply");
-    stackpos -= 2;
+    emit_binop_insn(node, NULL, "ora", true);
 }
 
 static void emit_binop_bitand(Node *node) {
+    if (node->ty->size == 4) {
+        emit_binop_long(node);
+        return;
+    }
     assert(node->ty->size == 2);
-    assert(node->left->ty->size == 2);
-    assert(node->right->ty->size == 2);
-    emit_expr(node->left);
-    emit("pha");
-    stackpos += 2;
-    emit_expr(node->right);
-    emit("and $1,S");
-    emit("ply");
-    stackpos -= 2;
-}
-
-static void emit_lognot(Node *node) {
-    emit_expr(node->operand);
-    assert(node->operand->ty->size == 2);
-    emit("cmp #$0000");
-
-    const char *bool_true = make_label();
-    const char *bool_cont = make_label();
-    emit("beq %s", bool_true);
-    emit("lda #$0000"); /* false */
-    emit("bra %s", bool_cont);
-    emit_label(bool_true);
-    emit("lda #$0001"); /* false */
-    emit_label(bool_cont);
-}
-
-/* left && right */
-static void emit_logand(Node *node) {
-    assert(node->left->ty->size == 2);
-    assert(node->right->ty->size == 2);
-
-    const char * const bool_end = make_label();
-    emit_expr(node->left);
-    emit("cmp #$0000");
-    emit("beq %s", bool_end);
-
-    emit_expr(node->right);
-    emit("cmp #$0000");
-    emit("beq %s", bool_end);
-    emit("lda #$0001");
-    emit_label(bool_end);
-}
-
-/* left || right */
-static void emit_logor(Node *node) {
-    assert(node->left->ty->size == 2);
-    assert(node->right->ty->size == 2);
-
-    const char * const bool_true = make_label();
-    const char * const bool_end = make_label();
-
-    emit_expr(node->left);
-    emit("cmp #$0000");
-    emit("bne %s", bool_true);
-
-    emit_expr(node->right);
-    emit("cmp #$0000");
-    emit("beq %s", bool_end);
-
-    emit_label(bool_true);
-    emit("lda #$0001");
-
-    emit_label(bool_end);
+    emit_binop_insn(node, NULL, "and", true);
 }
 
 static void emit_binop_not(Node *node) {
@@ -1231,6 +1937,9 @@ void emit_expr(Node *node) {
         case AST_RETURN:
             emit_return(node);
             break;
+        case AST_SWITCH:
+            emit_switch(node);
+            break;
         case AST_COMPOUND_STMT:
             for (size_t i = 0; i < vec_len(node->stmts); i++) {
                 emit_expr(vec_get(node->stmts, i));
@@ -1252,7 +1961,13 @@ void emit_expr(Node *node) {
             emit_post_op(node, '-');
             break;
         case '!':
-            emit_lognot(node);
+        case OP_LOGAND:
+        case OP_LOGOR:
+        case OP_EQ:
+        case OP_NE:
+        case '<':
+        case OP_LE:
+            emit_bool(node);
             break;
         case '&':
             emit_binop_bitand(node);
@@ -1263,12 +1978,6 @@ void emit_expr(Node *node) {
         case '~':
             emit_binop_not(node);
             break;
-        case OP_LOGAND:
-            emit_logand(node);
-            break;
-        case OP_LOGOR:
-            emit_logor(node);
-            break;
         case OP_CAST:
             emit_expr(node->operand);
             emit_load_convert(node->ty, node->operand->ty);
@@ -1284,18 +1993,6 @@ void emit_expr(Node *node) {
             if (node->ty->kind == KIND_PTR) {
                 emit_pointer_arith(node->kind, node->left, node->right);
                 break;
-            } else if (node->kind == '<') {
-                emit_cmp_lt(node);
-                break;
-            } else if (node->kind == OP_EQ) {
-                emit_cmp_eq(node);
-                break;
-            } else if (node->kind == OP_LE) {
-                emit_cmp_le(node);
-                break;
-            } else if (node->kind == OP_NE) {
-                emit_cmp_ne(node);
-                break;
             }
             if (is_inttype(node->ty)) {
                 emit_binop_int(node);
@@ -1312,6 +2009,8 @@ void emit_expr(Node *node) {
 }
 
 void emit_func(Node *func) {
+    funcbuf = make_vector();
+
     /* function prologue */
     emit_noident("; function!");
     emit_text_segment();
@@ -1322,14 +2021,18 @@ void emit_func(Node *func) {
 
     stackpos = 0;
 
+    if (dpframe) {
+        emit("phd");
+        stackpos += 2;
+    }
+
+    /* return address for rtl */
+    size_t off = 3;
+
     {
         /* assign offset to arguments */
 
-        /* return address for rtl */
-        size_t off = 3;
-
         if (vec_len(func->params) > 0) {
-            printf("vec_len(...) = %u\n", vec_len(func->params));
             if (vec_len(func->params) > 1) {
                 for (size_t i = vec_len(func->params) - 1; i > 0; i--) {
                     Node *v = vec_get(func->params, i - 1);
@@ -1342,17 +2045,16 @@ void emit_func(Node *func) {
             /* last argument in A */
             Node *v = vec_get(func->params, vec_len(func->params) - 1);
 
-            printf("v->ty->size = %u\n", v->ty->size);
             assert(v->loff == 0);
             if (v->ty->size <= 2 ) {
                 emit("pha");
                 stackpos += 2;
-                v->loff = 2;
+                v->loff = stackpos;
             } else if (v->ty->size == 4) {
-                emit("pha");
                 emit("phx");
+                emit("pha");
                 stackpos += 4;
-                v->loff = 4;
+                v->loff = stackpos;
             } else {
                 assert(0);
             }
@@ -1373,24 +2075,41 @@ void emit_func(Node *func) {
             emit_noident("; local offset = %#x\n", v->loff);
         }
 
-        if (localarea % 2 != 0) {
-            emit("phb");
-            stackpos += 1;
-        }
+        if (dpframe) {
+            /* D = S + 1, scratch area at the bottom of the frame */
+            const size_t framesize = localarea + DP_SCRATCH_SIZE;
+            emit("tsc");
+            emit("sec");
+            emit("sbc #$%04x", framesize);
+            emit("tcs");
+            emit("inc");
+            emit("tcd");
+            stackpos += framesize;
+            framepos = stackpos;
 
-        for (size_t i = 0; i < localarea / 2; i++) {
-            emit("phx");
-            stackpos += 2;
+            /* the highest parameter is at framepos + off - 2 */
+            if (framepos + off > 0xFF + 2) {
+                emit("sta $%02X", DP_FRAME_PTR);
+            }
+        } else {
+            emit_stack_alloc(localarea);
+            stackpos += localarea;
         }
     }
 
     /* function body */
     const size_t old_stackpos = stackpos;
+    retlabel = make_label();
+    retpos = stackpos;
     emit_expr(func->body);
     assert(old_stackpos == stackpos);
+    assert(tmp_used == 0);
 
-    /* function epilog */
+    /* function epilog, shared by all return statements */
+    emit_label(retlabel);
     emit_ret();
+
+    flush_func(func->fname);
 }
 
 static void emit_zero(size_t size) {
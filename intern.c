@@ -0,0 +1,119 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+/*
+ * String interning.
+ *
+ * intern() returns the same pointer for equal strings, so that
+ * identifiers can be compared by pointer instead of strcmp. The lexer
+ * interns every identifier, which makes the name of a TIDENT token an
+ * atom; hidesets rely on that.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#define INIT_SIZE 1024
+
+typedef struct {
+    uint32_t hash;
+    char *s;
+} Atom;
+
+static Atom *table;
+static int size;
+static int nelem;
+
+// Each atom is stored after a header that keeps its hash, so that
+// map.c does not need to hash interned keys again.
+typedef struct {
+    char *self;    // the atom, to tell it from a pointer into another one
+    uint32_t hash;
+} Header;
+
+// Atoms are carved out of blocks that double in size, so there are
+// only a few of them to search in atom_hash().
+#define MIN_BLOCK (64 * 1024)
+#define MAX_BLOCKS 32
+
+static struct {
+    char *p;
+    char *end;
+} blocks[MAX_BLOCKS];
+static int nblocks;
+static char *cur;  // next free byte in the newest block
+
+static char *new_atom(char *p, int len, uint32_t h) {
+    size_t need = (sizeof(Header) + len + 1 + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+    if (!nblocks || blocks[nblocks - 1].end - cur < need) {
+        if (nblocks == MAX_BLOCKS)
+            error("too many identifiers");
+        size_t n = nblocks ? (blocks[nblocks - 1].end - blocks[nblocks - 1].p) * 2 : MIN_BLOCK;
+        if (n < need)
+            n = need;
+        cur = alloc(ALLOC_ATOM, n);
+        blocks[nblocks].p = cur;
+        blocks[nblocks].end = cur + n;
+        nblocks++;
+    }
+    Header *hd = (Header *)cur;
+    char *s = cur + sizeof(Header);
+    cur += need;
+    *hd = (Header){ s, h };
+    memcpy(s, p, len);
+    return s;
+}
+
+static void rehash(void) {
+    int newsize = size ? size * 2 : INIT_SIZE;
+    Atom *t = calloc(newsize, sizeof(Atom));
+    int mask = newsize - 1;
+    for (int i = 0; i < size; i++) {
+        if (!table[i].s)
+            continue;
+        int j = table[i].hash & mask;
+        while (t[j].s)
+            j = (j + 1) & mask;
+        t[j] = table[i];
+    }
+    free(table);
+    table = t;
+    size = newsize;
+}
+
+// Interns the len bytes at p, which need not be NUL-terminated.
+char *intern_len(char *p, int len) {
+    if (nelem * 2 >= size)
+        rehash();
+    uint32_t h = fnv_hash(p, len);
+    int mask = size - 1;
+    int i = h & mask;
+    for (; table[i].s; i = (i + 1) & mask) {
+        char *s = table[i].s;
+        if (table[i].hash == h && !strncmp(s, p, len) && s[len] == '\0')
+            return s;
+    }
+    char *s = new_atom(p, len, h);
+    table[i] = (Atom){ h, s };
+    nelem++;
+    return s;
+}
+
+char *intern(char *s) {
+    return intern_len(s, strlen(s));
+}
+
+// Sets *h to the hash of s and returns true if s is an atom.
+bool atom_hash(char *s, uint32_t *h) {
+    uintptr_t a = (uintptr_t)s;
+    for (int i = nblocks - 1; i >= 0; i--) {
+        if (a < (uintptr_t)blocks[i].p + sizeof(Header) || a >= (uintptr_t)blocks[i].end)
+            continue;
+        Header *hd = (Header *)(s - sizeof(Header));
+        if ((a - (uintptr_t)blocks[i].p) % sizeof(char *) || hd->self != s)
+            return false;
+        *h = hd->hash;
+        return true;
+    }
+    return false;
+}
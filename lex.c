@@ -49,8 +49,12 @@ static char *pos_string(Pos *p) {
 
 static void skip_block_comment(void);
 
-void lex_init(char *filename) {
+void lex_init() {
     vec_push(buffers, make_vector());
+}
+
+// Starts reading the main source file.
+void lex_open(char *filename) {
     if (!strcmp(filename, "-")) {
         stream_push(make_file(stdin, "-"));
         return;
@@ -71,8 +75,7 @@ static void mark() {
 }
 
 static Token *make_token(Token *tmpl) {
-    Token *r = malloc(sizeof(Token));
-    *r = *tmpl;
+    Token *r = alloc_copy(ALLOC_TOKEN, tmpl, sizeof(Token));
     r->hideset = NULL;
     File *f = current_file();
     r->file = f;
@@ -125,7 +128,9 @@ static bool next(int expect) {
 }
 
 static void skip_line() {
+    char *s;
     for (;;) {
+        read_span(SPAN_LINE_COMMENT, &s);
         int c = readc();
         if (c == EOF)
             return;
@@ -137,6 +142,9 @@ static void skip_line() {
 }
 
 static bool do_skip_space() {
+    char *s;
+    if (read_span(SPAN_SPACE, &s))
+        return true;
     int c = readc();
     if (c == EOF)
         return false;
@@ -371,9 +379,16 @@ static Token *read_string(int enc) {
 }
 
 static Token *read_ident(char c) {
-    Buffer *b = make_buffer();
+    // The name is interned, so the buffer can be reused.
+    static Buffer *b;
+    if (!b)
+        b = make_buffer();
+    b->len = 0;
     buf_write(b, c);
     for (;;) {
+        char *s;
+        int len = read_span(SPAN_IDENT, &s);
+        buf_append(b, s, len);
         c = readc();
         if (isalnum(c) || (c & 0x80) || c == '_' || c == '$') {
             buf_write(b, c);
@@ -386,8 +401,7 @@ static Token *read_ident(char c) {
             continue;
         }
         unreadc(c);
-        buf_write(b, '\0');
-        return make_ident(buf_body(b));
+        return make_ident(intern_len(buf_body(b), buf_len(b)));
     }
 }
 
@@ -395,6 +409,9 @@ static void skip_block_comment() {
     Pos p = get_pos(-2);
     bool maybe_end = false;
     for (;;) {
+        char *s;
+        if (!maybe_end)
+            read_span(SPAN_BLOCK_COMMENT, &s);
         int c = readc();
         if (c == EOF)
             errorp(p, "premature end of block comment");
@@ -480,7 +497,7 @@ static Token *do_read_token() {
         if (next('.')) {
             if (next('.'))
                 return make_keyword(KELLIPSIS);
-            return make_ident("..");
+            return make_ident(intern(".."));
         }
         return make_keyword('.');
     case '(': case ')': case ',': case ';': case '[': case ']': case '{':
@@ -599,6 +616,7 @@ Token *lex() {
         return vec_pop(buf);
     if (vec_len(buffers) > 1)
         return eof_token;
+    phase_enter(PHASE_LEX);
     bool bol = (current_file()->column == 1);
     Token *tok = do_read_token();
     while (tok->kind == TSPACE) {
@@ -606,5 +624,6 @@ Token *lex() {
         tok->space = true;
     }
     tok->bol = bol;
+    phase_exit();
     return tok;
 }
@@ -0,0 +1,130 @@
+.p816
+.a16
+.i16
+
+; long __div32(long a, long b)
+;
+; Returns a / b in X:A and leaves a % b in $08-$0B of the direct page.
+; Follows the C calling convention: a is on the stack, b in X:A.
+; __div32 is unsigned, __sdiv32 rounds towards zero like C. Clobbers Y
+; and $00-$0F of the direct page.
+
+.import __divmod16
+
+.export __div32
+__div32:
+    jsr load
+    ; both fit in 16 bits
+    lda $02
+    ora $06
+    bne @long
+    lda $00
+    ldx $04
+    jsl __divmod16
+    stx $08
+    stz $0A
+    ldx #$0000
+    rtl
+@long:
+    jsr udiv32
+    lda $00
+    ldx $02
+    rtl
+
+.export __sdiv32
+__sdiv32:
+    jsr load
+    ; the remainder takes the sign of the dividend, the quotient is
+    ; negative if the signs differ
+    lda $02
+    sta $0C
+    eor $06
+    sta $0E
+    lda $02
+    bpl @1
+    lda #$0000
+    sec
+    sbc $00
+    sta $00
+    lda #$0000
+    sbc $02
+    sta $02
+@1:
+    lda $06
+    bpl @2
+    lda #$0000
+    sec
+    sbc $04
+    sta $04
+    lda #$0000
+    sbc $06
+    sta $06
+@2:
+    jsr udiv32
+    bit $0E
+    bpl @3
+    lda #$0000
+    sec
+    sbc $00
+    sta $00
+    lda #$0000
+    sbc $02
+    sta $02
+@3:
+    bit $0C
+    bpl @4
+    lda #$0000
+    sec
+    sbc $08
+    sta $08
+    lda #$0000
+    sbc $0A
+    sta $0A
+@4:
+    lda $00
+    ldx $02
+    rtl
+
+; $00-$03 = a, $04-$07 = b
+load:
+    sta $04
+    stx $06
+    ; a is above our return address and the caller's
+    lda 6,S
+    sta $00
+    lda 8,S
+    sta $02
+    rts
+
+; $00-$03 = $00-$03 / $04-$07, $08-$0B = remainder
+udiv32:
+    stz $08
+    stz $0A
+    ldy #32
+@loop:
+    asl $00
+    rol $02
+    rol $08
+    rol $0A
+    ; the remainder may have outgrown 32 bits if b is large
+    bcs @sub
+    lda $0A
+    cmp $06
+    bcc @next
+    bne @sub
+    lda $08
+    cmp $04
+    bcc @next
+@sub:
+    lda $08
+    sec
+    sbc $04
+    sta $08
+    lda $0A
+    sbc $06
+    sta $0A
+    inc $00
+@next:
+    dey
+    bne @loop
+    rts
@@ -0,0 +1,80 @@
+.p816
+.a16
+.i16
+
+; A = A / X, X = A % X
+;
+; Called by the compiler with a register convention instead of the C
+; one. __divmod16 is unsigned, __sdivmod16 rounds towards zero like C.
+; Clobbers Y and $00-$03 of the direct page, __sdivmod16 also $06-$09.
+
+.export __divmod16
+__divmod16:
+    stx $02
+    cmp $02
+    bcc @small
+    ; skip eight iterations if the dividend fits in a byte
+    ldy #16
+    cmp #$0100
+    bcs @start
+    xba
+    ldy #8
+@start:
+    sta $00
+    lda #$0000
+@loop:
+    asl $00
+    rol a
+    bcs @sub
+    cmp $02
+    bcc @next
+@sub:
+    sbc $02
+    inc $00
+@next:
+    dey
+    bne @loop
+    tax
+    lda $00
+    rtl
+@small:
+    ; quotient 0, the dividend is the remainder
+    tax
+    lda #$0000
+    rtl
+
+.export __sdivmod16
+__sdivmod16:
+    ; the remainder takes the sign of the dividend, the quotient is
+    ; negative if the signs differ
+    sta $06
+    txa
+    eor $06
+    sta $08
+    txa
+    bpl @1
+    eor #$FFFF
+    inc a
+    tax
+@1:
+    lda $06
+    bpl @2
+    eor #$FFFF
+    inc a
+@2:
+    jsl __divmod16
+    bit $08
+    bpl @3
+    eor #$FFFF
+    inc a
+@3:
+    bit $06
+    bpl @4
+    pha
+    txa
+    eor #$FFFF
+    inc a
+    tax
+    pla
+@4:
+    rtl
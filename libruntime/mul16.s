@@ -0,0 +1,33 @@
+.p816
+.a16
+.i16
+
+; A = A * X, modulo $10000
+;
+; Called by the compiler with a register convention instead of the C
+; one. Clobbers X, Y and $00-$03 of the direct page.
+
+.export __mul16
+__mul16:
+    ; the loop runs once per bit of the multiplier, make it the smaller one
+    stx $02
+    cmp $02
+    bcs @ordered
+    sta $02
+    txa
+@ordered:
+    sta $00
+    lda #$0000
+    ldx $02
+    beq @done
+@loop:
+    lsr $02
+    bcc @skip
+    clc
+    adc $00
+@skip:
+    asl $00
+    ldx $02
+    bne @loop
+@done:
+    rtl
@@ -0,0 +1,61 @@
+.p816
+.a16
+.i16
+
+; long __mul32(long a, long b)
+;
+; Returns a * b modulo $100000000 in X:A. Follows the C calling
+; convention: a is on the stack, b in X:A. Clobbers Y and $00-$0B of
+; the direct page.
+
+.export __mul32
+__mul32:
+    sta $00
+    stx $02
+    lda 4,S
+    sta $04
+    lda 6,S
+    sta $06
+    ; the loop runs once per bit of the multiplier ($00), make it the
+    ; smaller one
+    lda $02
+    cmp $06
+    bcc @ordered
+    bne @swap
+    lda $00
+    cmp $04
+    bcc @ordered
+@swap:
+    ldx $00
+    ldy $04
+    sty $00
+    stx $04
+    ldx $02
+    ldy $06
+    sty $02
+    stx $06
+@ordered:
+    stz $08
+    stz $0A
+@loop:
+    lda $00
+    ora $02
+    beq @done
+    lsr $02
+    ror $00
+    bcc @skip
+    clc
+    lda $08
+    adc $04
+    sta $08
+    lda $0A
+    adc $06
+    sta $0A
+@skip:
+    asl $04
+    rol $06
+    bra @loop
+@done:
+    lda $08
+    ldx $0A
+    rtl
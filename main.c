@@ -1,24 +1,43 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+#include <errno.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include "8cc.h"
 
+static Vector *infiles = &EMPTY_VECTOR;
 static char *infile;
 static char *outfile;
 static char *asmfile;
 static bool dumpast;
 static bool cpponly;
 static bool dumpasm = false;
+static bool foldast = true;
+static bool memreport;
+static char *pchheader;
 static bool dontlink;
+static int jobs = 1;
 static Buffer *cppdefs;
 static Vector *tmpfiles = &EMPTY_VECTOR;
 
+// In a compile server, true if -I, -D and -U have been applied ahead
+// of time, and the declarations of the -fpch header if it was loaded,
+// along with the precompiled header file it was loaded from.
+static bool warm;
+static Vector *warm_decls;
+static struct stat warm_pch;
+
+#define OPTSTRING "I:ED:O:SU:W:acd:f:gj:m:o:hw"
+
 static void usage(int exitcode) {
     fprintf(exitcode ? stderr : stdout,
-            "Usage: 8cc [ -E ][ -a ] [ -h ] <file>\n\n"
+            "Usage: 8cc [ -E ][ -a ] [ -h ] <file>...\n"
+            "       8cc --server=<socket> [ -I<path> -D<name> -U<name> -fpch=<header> ]\n"
+            "       8cc --connect=<socket> <option>... <file>...\n\n"
             "\n"
             "  -I<path>          add to include path\n"
             "  -E                print preprocessed source code\n"
@@ -29,7 +48,17 @@ static void usage(int exitcode) {
             "  -U name           Undefine name\n"
             "  -fdump-ast        print AST\n"
             "  -fdump-stack      Print stacktrace\n"
-            "  -fno-dump-source  Do not emit source code as assembly comment\n"
+            "  -fdump-source     Comment each line with the line of gen.c that emitted it\n"
+            "  -fno-fold         Do not simplify constant expressions\n"
+            "  -fno-dp-temps     Keep expression temporaries on the stack\n"
+            "  -fdp-frame        Address locals through the direct page register\n"
+            "  -fno-peephole     Do not run the peephole optimizer\n"
+            "  -fcost-report     Annotate code with estimated bytes and cycles\n"
+            "  -fmem-report      Print memory allocated per object kind\n"
+            "  -ftime-report     Print time and memory spent per phase\n"
+            "  -ftime-report=json\n"
+            "  -fpch=<header>    Read header first, precompiled to <header>.pch\n"
+            "  -j <number>       Compile up to <number> files at a time\n"
             "  -o filename       Output to the specified file\n"
             "  -g                Do nothing at this moment\n"
             "  -Wall             Enable all warnings\n"
@@ -61,9 +90,13 @@ static char *replace_suffix(char *filename, char suffix) {
     return r;
 }
 
+static char *asm_path(char *file) {
+    return outfile ? outfile : replace_suffix(base(file), 's');
+}
+
 static FILE *open_asmfile() {
     if (dumpasm) {
-        asmfile = outfile ? outfile : replace_suffix(base(infile), 's');
+        asmfile = asm_path(infile);
     } else {
         asmfile = format("/tmp/8ccXXXXXX.s");
         if (!mkstemps(asmfile, 2))
@@ -90,8 +123,28 @@ static void parse_f_arg(char *s) {
         dumpast = true;
     else if (!strcmp(s, "dump-stack"))
         dumpstack = true;
+    else if (!strcmp(s, "dump-source"))
+        dumpsource = true;
     else if (!strcmp(s, "no-dump-source"))
         dumpsource = false;
+    else if (!strcmp(s, "no-fold"))
+        foldast = false;
+    else if (!strcmp(s, "no-dp-temps"))
+        dptemps = false;
+    else if (!strcmp(s, "dp-frame"))
+        dpframe = true;
+    else if (!strcmp(s, "no-peephole"))
+        peepopt = false;
+    else if (!strcmp(s, "cost-report"))
+        costreport = true;
+    else if (!strcmp(s, "mem-report"))
+        memreport = true;
+    else if (!strcmp(s, "time-report"))
+        timereport = true;
+    else if (!strcmp(s, "time-report=json"))
+        timereport = timereport_json = true;
+    else if (!strncmp(s, "pch=", 4))
+        pchheader = s + 4;
     else
         usage(1);
 }
@@ -103,12 +156,17 @@ static void parse_m_arg(char *s) {
 
 static void parseopt(int argc, char **argv) {
     cppdefs = make_buffer();
+    infiles = make_vector();
+    optind = 1;
     for (;;) {
-        int opt = getopt(argc, argv, "I:ED:O:SU:W:acd:f:gm:o:hw");
+        int opt = getopt(argc, argv, OPTSTRING);
         if (opt == -1)
             break;
         switch (opt) {
-        case 'I': add_include_path(optarg); break;
+        case 'I':
+            if (!warm)
+                add_include_path(optarg);
+            break;
         case 'E': cpponly = true; break;
         case 'D': {
             char *p = strchr(optarg, '=');
@@ -127,6 +185,11 @@ static void parseopt(int argc, char **argv) {
         case 'f': parse_f_arg(optarg); break;
         case 'm': parse_m_arg(optarg); break;
         case 'g': break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1)
+                error("invalid number of jobs: %s", optarg);
+            break;
         case 'o': outfile = optarg; break;
         case 'w': enable_warning = false; break;
         case 'h':
@@ -135,8 +198,10 @@ static void parseopt(int argc, char **argv) {
             usage(1);
         }
     }
-    if (optind != argc - 1)
+    if (optind == argc)
         usage(1);
+    for (int i = optind; i < argc; i++)
+        vec_push(infiles, argv[i]);
 
     if (!dumpast && !cpponly && !dumpasm && !dontlink)
         error("One of -a, -c, -E or -S must be specified");
@@ -144,7 +209,10 @@ static void parseopt(int argc, char **argv) {
     if (!dumpasm) {
         error("-S is required!");
     }
-    infile = argv[optind];
+    if (pchheader && cpponly)
+        error("-fpch cannot be used with -E");
+    if (outfile && vec_len(infiles) > 1)
+        error("-o cannot be used with multiple input files");
 }
 
 char *get_base_file() {
@@ -163,34 +231,270 @@ static void preprocess() {
         printf("%s", tok2s(tok));
     }
     printf("\n");
-    exit(0);
 }
 
-int main(int argc, char **argv) {
-    setbuf(stdout, NULL);
-    if (atexit(delete_temp_files))
-        perror("atexit");
-    parseopt(argc, argv);
-    lex_init(infile);
-    cpp_init();
-    parse_init();
-    set_output_file(open_asmfile());
-    if (buf_len(cppdefs) > 0)
+static void compile_toplevel(Node *v) {
+    if (foldast) {
+        phase_enter(PHASE_FOLD);
+        fold_toplevel(v);
+        phase_exit();
+    }
+    if (dumpast) {
+        printf("%s\n", node2s(v));
+        return;
+    }
+    long start = timereport ? time_now() : 0;
+    phase_enter(PHASE_CODEGEN);
+    emit_toplevel(v);
+    phase_exit();
+    if (timereport && v->kind == AST_FUNC)
+        record_func_time(v->fname, time_now() - start);
+}
+
+/*
+ * Reads the header given by -fpch, from its precompiled form if that
+ * is up to date. The header is saved only if it makes nothing but
+ * declarations: code and data would have to be emitted again, and
+ * static variables take labels that the source file could reuse.
+ */
+static void read_pch_header() {
+    char *pchfile = format("%s.pch", pchheader);
+    char *defs = buf_body(cppdefs);
+    Vector *decls = load_pch(pchfile, pchheader, defs);
+    if (decls) {
+        for (int i = 0; i < vec_len(decls); i++)
+            compile_toplevel(vec_get(decls, i));
+        return;
+    }
+    FILE *fp = fopen(pchheader, "r");
+    if (!fp)
+        error("cannot open %s: %s", pchheader, strerror(errno));
+    int first = vec_len(input_files());
+    stream_stash(make_file(fp, pchheader));
+    decls = make_vector();
+    bool cacheable = true;
+    for (;;) {
+        Vector *toplevels = read_toplevel();
+        if (!toplevels)
+            break;
+        for (int i = 0; i < vec_len(toplevels); i++) {
+            Node *v = vec_get(toplevels, i);
+            if (v->kind == AST_DECL && !v->declinit && !v->declvar->ty->isstatic)
+                vec_push(decls, v);
+            else
+                cacheable = false;
+            compile_toplevel(v);
+        }
+    }
+    stream_unstash();
+    if (cacheable)
+        save_pch(pchfile, pchheader, defs, first, decls);
+    else
+        warn("%s defines code or data and is not precompiled", pchheader);
+}
+
+static void compile(char *file) {
+    infile = file;
+    lex_open(infile);
+    // -E writes to stdout, so no assembly file is made
+    if (!cpponly)
+        set_output_file(open_asmfile());
+    if (!warm && buf_len(cppdefs) > 0)
         read_from_string(buf_body(cppdefs));
+    if (warm_decls) {
+        for (int i = 0; i < vec_len(warm_decls); i++)
+            compile_toplevel(vec_get(warm_decls, i));
+    } else if (pchheader) {
+        read_pch_header();
+    }
 
-    if (cpponly)
+    if (cpponly) {
         preprocess();
-
-    Vector *toplevels = read_toplevels();
-    for (int i = 0; i < vec_len(toplevels); i++) {
-        Node *v = vec_get(toplevels, i);
-        if (dumpast)
-            printf("%s\n", node2s(v));
-        else
-            emit_toplevel(v);
+    } else {
+        // Toplevels are emitted as soon as they are read, and their nodes
+        // are freed right after, so memory use does not grow with the
+        // number of functions.
+        for (;;) {
+            AllocMark mark = alloc_mark(ALLOC_NODE);
+            phase_enter(PHASE_PARSE);
+            Vector *toplevels = read_toplevel();
+            phase_exit();
+            if (!toplevels)
+                break;
+            for (int i = 0; i < vec_len(toplevels); i++)
+                compile_toplevel(vec_get(toplevels, i));
+            alloc_release(ALLOC_NODE, mark);
+        }
+        phase_enter(PHASE_CODEGEN);
+        close_output_file();
+        phase_exit();
     }
+    if (timereport)
+        print_time_report(infile);
+}
 
-    close_output_file();
+// Waits for a child and returns true if it failed.
+static bool wait_child() {
+    int status;
+    if (wait(&status) < 0)
+        error("wait failed: %s", strerror(errno));
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/*
+ * Compiles each input file in a child process, up to jobs at a time.
+ * The compiler keeps its state in globals, so a process is the unit
+ * of isolation. Children start from the state cpp_init and parse_init
+ * made in the parent, so that is done only once.
+ */
+static int compile_all() {
+    // -E and -fdump-ast write to stdout, which the children share
+    int max = (cpponly || dumpast) ? 1 : jobs;
+    int running = 0;
+    bool failed = false;
+    for (int i = 0; i < vec_len(infiles); i++) {
+        if (running == max) {
+            failed |= wait_child();
+            running--;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+            error("fork failed: %s", strerror(errno));
+        if (pid == 0) {
+            compile(vec_get(infiles, i));
+            exit(0);
+        }
+        running++;
+    }
+    for (; running > 0; running--)
+        failed |= wait_child();
+    return failed;
+}
 
+// Runs the compiler with the given command line, after init().
+static int compile_args(int argc, char **argv) {
+    parseopt(argc, argv);
+    timing_start();
+    if (memreport && atexit(print_alloc_stats))
+        perror("atexit");
+    if (vec_len(infiles) > 1)
+        return compile_all();
+    compile(vec_head(infiles));
     return 0;
 }
+
+// Returns the assembly files that compile_args made.
+static Vector *output_files() {
+    Vector *r = make_vector();
+    if (cpponly)
+        return r;
+    for (int i = 0; i < vec_len(infiles); i++)
+        vec_push(r, asm_path(vec_get(infiles, i)));
+    return r;
+}
+
+/*
+ * Returns the options in argv that the state before the source file
+ * depends on: -I, -D, -U and -fpch. A compile server keeps that state
+ * for each set of them.
+ */
+static Vector *warm_config(int argc, char **argv) {
+    Vector *r = make_vector();
+    opterr = 0;
+    optind = 1;
+    for (;;) {
+        int opt = getopt(argc, argv, OPTSTRING);
+        if (opt == -1)
+            break;
+        if (opt == 'I' || opt == 'D' || opt == 'U')
+            vec_push(r, format("-%c%s", opt, optarg));
+        else if (opt == 'f' && !strncmp(optarg, "pch=", 4))
+            vec_push(r, format("-f%s", optarg));
+    }
+    opterr = 1;
+    return r;
+}
+
+// Builds the precompiled header if it is out of date, in a child so
+// that a header that cannot be precompiled is not left read here.
+static void build_pch(char *pchfile, char *defs) {
+    if (pch_is_current(pchfile, pchheader, defs))
+        return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        set_output_file(fopen("/dev/null", "w"));
+        read_pch_header();
+        exit(0);
+    }
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+// Applies the options of warm_config ahead of any compilation, and
+// loads the -fpch header.
+static void warm_up(Vector *config) {
+    Vector *args = make_vector();
+    vec_push(args, "8cc");
+    vec_push(args, "-S");
+    // parseopt edits -D arguments in place
+    for (int i = 0; i < vec_len(config); i++)
+        vec_push(args, format("%s", vec_get(config, i)));
+    vec_push(args, "-");
+    vec_push(args, NULL);
+    parseopt(vec_len(args) - 1, vec_body(args));
+    if (buf_len(cppdefs) > 0)
+        read_from_string(buf_body(cppdefs));
+    if (pchheader) {
+        char *pchfile = format("%s.pch", pchheader);
+        build_pch(pchfile, buf_body(cppdefs));
+        if (!stat(pchfile, &warm_pch))
+            warm_decls = load_pch(pchfile, pchheader, buf_body(cppdefs));
+    }
+    warm = true;
+}
+
+// Returns false if the header loaded by warm_up has changed since. The
+// precompiled header has to be the same file, as another compilation
+// may have replaced it with one made from the changed header.
+static bool warm_is_current() {
+    if (!warm_decls)
+        return true;
+    char *pchfile = format("%s.pch", pchheader);
+    struct stat st;
+    if (stat(pchfile, &st) || st.st_ino != warm_pch.st_ino || st.st_size != warm_pch.st_size
+        || st.st_mtim.tv_sec != warm_pch.st_mtim.tv_sec
+        || st.st_mtim.tv_nsec != warm_pch.st_mtim.tv_nsec)
+        return false;
+    return pch_is_current(pchfile, pchheader, buf_body(cppdefs));
+}
+
+static void init() {
+    lex_init();
+    cpp_init();
+    parse_init();
+}
+
+int main(int argc, char **argv) {
+    setbuf(stdout, NULL);
+    if (atexit(delete_temp_files))
+        perror("atexit");
+    if (argc >= 2 && !strncmp(argv[1], "--server=", 9)) {
+        init();
+        Compiler cc = {
+            warm_config, warm_up, warm_is_current, compile_args, output_files,
+        };
+        // The options that follow get "--server" in the place of argv[0]
+        run_server(argv[1] + 9, &cc, argc - 1, argv + 1);
+    }
+    if (argc >= 2 && !strncmp(argv[1], "--connect=", 10)) {
+        int status = run_client(argv[1] + 10, argc - 2, argv + 2);
+        if (status >= 0)
+            return status;
+        // No server is running; compile here instead.
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    init();
+    return compile_args(argc, argv);
+}
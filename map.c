@@ -9,21 +9,38 @@
 #define INIT_SIZE 16
 #define TOMBSTONE ((void *)-1)
 
-static uint32_t hash(char *p) {
-    // FNV hash
+// FNV hash. Also used for atoms and sets.
+uint32_t fnv_hash(void *p, int len) {
+    unsigned char *s = p;
     uint32_t r = 2166136261;
-    for (; *p; p++) {
-        r ^= *p;
+    for (int i = 0; i < len; i++) {
+        r ^= s[i];
         r *= 16777619;
     }
     return r;
 }
 
+// Atoms carry their hash, which is the hash of their contents.
+static uint32_t hash(char *key) {
+    uint32_t h;
+    if (atom_hash(key, &h))
+        return h;
+    return fnv_hash(key, strlen(key));
+}
+
+// Identifiers are interned, so keys are often the same pointer.
+// Otherwise the stored hash rules out most mismatches without a strcmp.
+static bool same_key(Map *m, int i, char *key, uint32_t h) {
+    char *k = m->key[i];
+    return k == key || (m->hash[i] == h && k != TOMBSTONE && !strcmp(k, key));
+}
+
 static Map *do_make_map(Map *parent, int size) {
     Map *r = malloc(sizeof(Map));
     r->parent = parent;
     r->key = calloc(size, sizeof(char *));
     r->val = calloc(size, sizeof(void *));
+    r->hash = calloc(size, sizeof(uint32_t));
     r->size = size;
     r->nelem = 0;
     r->nused = 0;
@@ -34,6 +51,7 @@ static void maybe_rehash(Map *m) {
     if (!m->key) {
         m->key = calloc(INIT_SIZE, sizeof(char *));
         m->val = calloc(INIT_SIZE, sizeof(void *));
+        m->hash = calloc(INIT_SIZE, sizeof(uint32_t));
         m->size = INIT_SIZE;
         return;
     }
@@ -42,21 +60,24 @@ static void maybe_rehash(Map *m) {
     int newsize = (m->nelem < m->size * 0.35) ? m->size : m->size * 2;
     char **k = calloc(newsize, sizeof(char *));
     void **v = calloc(newsize, sizeof(void *));
+    uint32_t *h = calloc(newsize, sizeof(uint32_t));
     int mask = newsize - 1;
     for (int i = 0; i < m->size; i++) {
         if (m->key[i] == NULL || m->key[i] == TOMBSTONE)
             continue;
-        int j = hash(m->key[i]) & mask;
+        int j = m->hash[i] & mask;
         for (;; j = (j + 1) & mask) {
             if (k[j] != NULL)
                 continue;
             k[j] = m->key[i];
             v[j] = m->val[i];
+            h[j] = m->hash[i];
             break;
         }
     }
     m->key = k;
     m->val = v;
+    m->hash = h;
     m->size = newsize;
     m->nused = m->nelem;
 }
@@ -69,43 +90,46 @@ Map *make_map_parent(Map *parent) {
     return do_make_map(parent, INIT_SIZE);
 }
 
-static void *map_get_nostack(Map *m, char *key) {
+static void *map_get_nostack(Map *m, char *key, uint32_t h) {
     if (!m->key)
         return NULL;
     int mask = m->size - 1;
-    int i = hash(key) & mask;
+    int i = h & mask;
     for (; m->key[i] != NULL; i = (i + 1) & mask)
-        if (m->key[i] != TOMBSTONE && !strcmp(m->key[i], key))
+        if (same_key(m, i, key, h))
             return m->val[i];
     return NULL;
 }
 
 void *map_get(Map *m, char *key) {
-    void *r = map_get_nostack(m, key);
-    if (r)
-        return r;
+    uint32_t h = hash(key);
     // Map is stackable. If no value is found,
     // continue searching from the parent.
-    if (m->parent)
-        return map_get(m->parent, key);
+    for (; m; m = m->parent) {
+        void *r = map_get_nostack(m, key, h);
+        if (r)
+            return r;
+    }
     return NULL;
 }
 
 void map_put(Map *m, char *key, void *val) {
     maybe_rehash(m);
+    uint32_t h = hash(key);
     int mask = m->size - 1;
-    int i = hash(key) & mask;
+    int i = h & mask;
     for (;; i = (i + 1) & mask) {
         char *k = m->key[i];
         if (k == NULL || k == TOMBSTONE) {
             m->key[i] = key;
             m->val[i] = val;
+            m->hash[i] = h;
             m->nelem++;
             if (k == NULL)
                 m->nused++;
             return;
         }
-        if (!strcmp(k, key)) {
+        if (same_key(m, i, key, h)) {
             m->val[i] = val;
             return;
         }
@@ -115,10 +139,11 @@ void map_put(Map *m, char *key, void *val) {
 void map_remove(Map *m, char *key) {
     if (!m->key)
         return;
+    uint32_t h = hash(key);
     int mask = m->size - 1;
-    int i = hash(key) & mask;
+    int i = h & mask;
     for (; m->key[i] != NULL; i = (i + 1) & mask) {
-        if (m->key[i] == TOMBSTONE || strcmp(m->key[i], key))
+        if (!same_key(m, i, key, h))
             continue;
         m->key[i] = TOMBSTONE;
         m->val[i] = NULL;
@@ -130,3 +155,12 @@ void map_remove(Map *m, char *key) {
 size_t map_len(Map *m) {
     return m->nelem;
 }
+
+// Returns the keys of m, not including those of its parents.
+Vector *map_keys(Map *m) {
+    Vector *r = make_vector();
+    for (int i = 0; i < m->size; i++)
+        if (m->key[i] && m->key[i] != TOMBSTONE)
+            vec_push(r, m->key[i]);
+    return r;
+}
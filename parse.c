@@ -89,12 +89,6 @@ static Node *read_comma_expr(void);
 static Token *get(void);
 static Token *peek(void);
 
-typedef struct {
-    int beg;
-    int end;
-    char *label;
-} Case;
-
 enum {
     S_TYPEDEF = 1,
     S_EXTERN,
@@ -116,7 +110,7 @@ enum {
 
 static void mark_location() {
     Token *tok = peek();
-    source_loc = malloc(sizeof(SourceLoc));
+    source_loc = alloc(ALLOC_OTHER, sizeof(SourceLoc));
     source_loc->file = tok->file->name;
     source_loc->line = tok->line;
 }
@@ -146,7 +140,7 @@ static char *make_static_label(char *name) {
 }
 
 static Case *make_case(int beg, int end, char *label) {
-    Case *r = malloc(sizeof(Case));
+    Case *r = alloc(ALLOC_OTHER, sizeof(Case));
     r->beg = beg;
     r->end = end;
     r->label = label;
@@ -158,8 +152,7 @@ static Map *env() {
 }
 
 static Node *make_ast(Node *tmpl) {
-    Node *r = malloc(sizeof(Node));
-    *r = *tmpl;
+    Node *r = alloc_copy(ALLOC_NODE, tmpl, sizeof(Node));
     r->sourceLoc = source_loc;
     return r;
 }
@@ -192,10 +185,18 @@ static Node *ast_lvar(Type *ty, char *name) {
     return r;
 }
 
+// Nodes in the global environment are looked up by later toplevels,
+// so they must not be released with the toplevel that defines them.
+static Node *env_put(Map *m, char *name, Node *node) {
+    if (m == globalenv)
+        node = alloc_copy(ALLOC_GLOBAL, node, sizeof(Node));
+    map_put(m, name, node);
+    return node;
+}
+
 static Node *ast_gvar(Type *ty, char *name) {
     Node *r = make_ast(&(Node){ AST_GVAR, ty, .varname = name, .glabel = name_to_label(name) });
-    map_put(globalenv, name, r);
-    return r;
+    return env_put(globalenv, name, r);
 }
 
 static Node *ast_static_lvar(Type *ty, char *name) {
@@ -212,8 +213,7 @@ static Node *ast_static_lvar(Type *ty, char *name) {
 
 static Node *ast_typedef(Type *ty, char *name) {
     Node *r = make_ast(&(Node){ AST_TYPEDEF, ty });
-    map_put(env(), name, r);
-    return r;
+    return env_put(env(), name, r);
 }
 
 static Node *ast_string(int enc, char *str, int len) {
@@ -329,24 +329,30 @@ static Node *ast_dest(char *label) {
     return make_ast(&(Node){ AST_LABEL, .label = name_to_label(label), .newlabel = name_to_label(label) });
 }
 
+static Node *ast_switch(Node *expr, Vector *cases, char *defaultcase) {
+    Vector *v = make_vector();
+    for (int i = 0; i < vec_len(cases); i++) {
+        Case *c = vec_get(cases, i);
+        vec_push(v, make_case(c->beg, c->end, name_to_label(c->label)));
+    }
+    return make_ast(&(Node){ AST_SWITCH, .switchexpr = expr, .switchcases = v,
+                             .switchdefault = name_to_label(defaultcase) });
+}
+
 static Node *ast_label_addr(char *label) {
     return make_ast(&(Node){ OP_LABEL_ADDR, make_ptr_type(type_void), .label = name_to_label(label) });
 }
 
 static Type *make_type(Type *tmpl) {
-    Type *r = malloc(sizeof(Type));
-    *r = *tmpl;
-    return r;
+    return alloc_copy(ALLOC_TYPE, tmpl, sizeof(Type));
 }
 
 static Type *copy_type(Type *ty) {
-    Type *r = malloc(sizeof(Type));
-    memcpy(r, ty, sizeof(Type));
-    return r;
+    return alloc_copy(ALLOC_TYPE, ty, sizeof(Type));
 }
 
 static Type *make_numtype(int kind, bool usig) {
-    Type *r = calloc(1, sizeof(Type));
+    Type *r = alloc(ALLOC_TYPE, sizeof(Type));
     r->kind = kind;
     assert(kind != NULL);
     r->usig = usig;
@@ -727,18 +733,23 @@ static Node *read_int(Token *tok) {
     if (*end != '\0')
         errort(tok, "invalid character '%c': %s", *end, s);
 
+    // The limits are the target's, not the host's.
+    unsigned long int_max = (1UL << (type_int->size * 8 - 1)) - 1;
+    unsigned long uint_max = (1UL << (type_int->size * 8)) - 1;
+    unsigned long long_max = (1UL << (type_long->size * 8 - 1)) - 1;
+
     // C11 6.4.4.1p5: Decimal constant type is int, long, or long long.
     // In 8cc, long and long long are the same size.
     bool base10 = (*s != '0');
     if (base10) {
-        ty = !(v & ~(long)INT_MAX) ? type_int : type_long;
+        ty = !(v & ~int_max) ? type_int : type_long;
         assert(ty != NULL);
         return ast_inttype(ty, v);
     }
     // Octal or hexadecimal constant type may be unsigned.
-    ty = !(v & ~(unsigned long)INT_MAX) ? type_int
-        : !(v & ~(unsigned long)UINT_MAX) ? type_uint
-        : !(v & ~(unsigned long)LONG_MAX) ? type_long
+    ty = !(v & ~int_max) ? type_int
+        : !(v & ~uint_max) ? type_uint
+        : !(v & ~long_max) ? type_long
         : type_ulong;
     assert(ty != NULL);
     return ast_inttype(ty, v);
@@ -1606,8 +1617,7 @@ static Type *read_enum_def() {
 
         if (next_token('='))
             val = read_intexpr();
-        Node *constval = ast_inttype(type_int, val++);
-        map_put(env(), name, constval);
+        env_put(env(), name, ast_inttype(type_int, val++));
         if (next_token(','))
             continue;
         if (next_token('}'))
@@ -2572,11 +2582,16 @@ static Node *read_switch_stmt() {
     SET_SWITCH_CONTEXT(end);
     Node *body = read_stmt();
     Vector *v = make_vector();
-    Node *var = ast_lvar(expr->ty, make_tempname());
-    vec_push(v, ast_binop(expr->ty, '=', var, expr));
-    for (int i = 0; i < vec_len(cases); i++)
-        vec_push(v, make_switch_jump(var, vec_get(cases, i)));
-    vec_push(v, ast_jump(defaultcase ? defaultcase : end));
+    if (expr->ty->size <= type_int->size) {
+        // The code generator picks a jump table or a compare tree.
+        vec_push(v, ast_switch(expr, cases, defaultcase ? defaultcase : end));
+    } else {
+        Node *var = ast_lvar(expr->ty, make_tempname());
+        vec_push(v, ast_binop(expr->ty, '=', var, expr));
+        for (int i = 0; i < vec_len(cases); i++)
+            vec_push(v, make_switch_jump(var, vec_get(cases, i)));
+        vec_push(v, ast_jump(defaultcase ? defaultcase : end));
+    }
     if (body)
         vec_push(v, body);
     vec_push(v, ast_dest(end));
@@ -2736,16 +2751,25 @@ static void read_decl_or_stmt(Vector *list) {
  * Compilation unit
  */
 
-Vector *read_toplevels() {
+// Reads one function definition or declaration. Returns the toplevel
+// nodes it makes, static local variables of a function first, or NULL
+// at the end of input.
+Vector *read_toplevel() {
+    if (peek()->kind == TEOF)
+        return NULL;
     toplevels = make_vector();
-    for (;;) {
-        if (peek()->kind == TEOF)
-            return toplevels;
-        if (is_funcdef())
-            vec_push(toplevels, read_funcdef());
-        else
-            read_decl(toplevels, true);
-    }
+    if (is_funcdef())
+        vec_push(toplevels, read_funcdef());
+    else
+        read_decl(toplevels, true);
+    return toplevels;
+}
+
+Vector *read_toplevels() {
+    Vector *r = make_vector();
+    for (Vector *v; (v = read_toplevel());)
+        vec_append(r, v);
+    return r;
 }
 
 /*
@@ -2785,6 +2809,41 @@ static Token *peek() {
     return peek_token();
 }
 
+/*
+ * Precompiled headers
+ */
+
+static void write_env(Pch *p, Map *m, bool istags) {
+    Vector *names = map_keys(m);
+    pch_put_int(p, vec_len(names));
+    for (int i = 0; i < vec_len(names); i++) {
+        char *name = vec_get(names, i);
+        pch_put_str(p, name);
+        if (istags)
+            pch_put_type(p, map_get(m, name));
+        else
+            pch_put_node(p, map_get(m, name));
+    }
+}
+
+static void read_env(Pch *p, Map *m, bool istags) {
+    int len = pch_get_int(p);
+    for (int i = 0; i < len; i++) {
+        char *name = pch_get_atom(p);
+        map_put(m, name, istags ? (void *)pch_get_type(p) : (void *)pch_get_node(p));
+    }
+}
+
+void write_parse_state(Pch *p) {
+    write_env(p, globalenv, false);
+    write_env(p, tags, true);
+}
+
+void read_parse_state(Pch *p) {
+    read_env(p, globalenv, false);
+    read_env(p, tags, true);
+}
+
 /*
  * Initializer
  */
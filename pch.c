@@ -0,0 +1,585 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Precompiled headers.
+ *
+ * -fpch=foo.h reads foo.h before the source file. What the header
+ * leaves behind is saved to foo.h.pch: the macros, the headers it
+ * included, the global names and the struct tags. A later compilation
+ * loads that file instead of reading the header again, as long as
+ * every file the header read has the same size and mtime, to the
+ * nanosecond, and -D, -U and the include path are unchanged.
+ *
+ * The file is a sequence of 32-bit words, which is mmapped to read.
+ * Strings are stored inline, NUL-terminated and padded to a word, so
+ * that they can be used in place. A type, node or file is written in
+ * full the first time it is referred to, and by index after that,
+ * which keeps shared and recursive types intact.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "8cc.h"
+
+#define PCH_MAGIC 0x48435038 // "8PCH"
+#define PCH_VERSION 2
+
+// A reference to an object that follows in full
+#define NEW_OBJECT -1
+
+struct Pch {
+    // Writing
+    Buffer *buf;
+    void **ptrs;  // open addressing table of objects written so far
+    int *ids;
+    int size;
+    int nobj;
+    // Reading
+    char *p;
+    char *end;
+    Vector *objs;
+};
+
+// Types that are not allocated but referred to by address. They get the
+// first ids, so that they are the same objects after loading.
+static Type **builtin_types[] = {
+    &type_void, &type_bool, &type_char, &type_short, &type_int, &type_long,
+    &type_llong, &type_uchar, &type_ushort, &type_uint, &type_ulong,
+    &type_ullong, &type_float, &type_double, &type_ldouble, &type_enum,
+};
+
+#define NBUILTIN ((int)(sizeof(builtin_types) / sizeof(*builtin_types)))
+
+/*
+ * Writer
+ */
+
+static int find_ptr(Pch *p, void *ptr) {
+    int mask = p->size - 1;
+    int i = ((uintptr_t)ptr >> 4) & mask;
+    while (p->ptrs[i] && p->ptrs[i] != ptr)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void grow_ptrs(Pch *p) {
+    void **ptrs = p->ptrs;
+    int *ids = p->ids;
+    int size = p->size;
+    p->size = size ? size * 2 : 256;
+    p->ptrs = calloc(p->size, sizeof(void *));
+    p->ids = calloc(p->size, sizeof(int));
+    for (int i = 0; i < size; i++) {
+        if (!ptrs[i])
+            continue;
+        int j = find_ptr(p, ptrs[i]);
+        p->ptrs[j] = ptrs[i];
+        p->ids[j] = ids[i];
+    }
+    free(ptrs);
+    free(ids);
+}
+
+static void add_obj(Pch *p, void *ptr) {
+    if (p->nobj * 2 >= p->size)
+        grow_ptrs(p);
+    int i = find_ptr(p, ptr);
+    p->ptrs[i] = ptr;
+    p->ids[i] = ++p->nobj;
+}
+
+void pch_put_int(Pch *p, int v) {
+    buf_append(p->buf, (char *)&v, sizeof(v));
+}
+
+static void put_long(Pch *p, long v) {
+    pch_put_int(p, (int)(v & 0xFFFFFFFF));
+    pch_put_int(p, (int)(v >> 32));
+}
+
+static void put_bytes(Pch *p, char *s, int len) {
+    pch_put_int(p, len);
+    buf_append(p->buf, s, len);
+    for (int i = len; i % 4 != 3; i++)
+        buf_write(p->buf, '\0');
+    buf_write(p->buf, '\0');
+}
+
+void pch_put_str(Pch *p, char *s) {
+    if (!s)
+        pch_put_int(p, -1);
+    else
+        put_bytes(p, s, strlen(s));
+}
+
+// Writes the index of ptr, and returns true if the object has to
+// follow because it is written for the first time.
+static bool put_ref(Pch *p, void *ptr) {
+    if (!ptr) {
+        pch_put_int(p, 0);
+        return false;
+    }
+    if (p->size) {
+        int i = find_ptr(p, ptr);
+        if (p->ptrs[i]) {
+            pch_put_int(p, p->ids[i]);
+            return false;
+        }
+    }
+    add_obj(p, ptr);
+    pch_put_int(p, NEW_OBJECT);
+    return true;
+}
+
+void pch_put_type(Pch *p, Type *ty) {
+    if (!put_ref(p, ty))
+        return;
+    pch_put_int(p, ty->kind);
+    pch_put_int(p, ty->size);
+    pch_put_int(p, ty->align);
+    pch_put_int(p, ty->usig | ty->isextern << 1 | ty->isstatic << 2 | ty->is_struct << 3
+                | ty->hasva << 4 | ty->oldstyle << 5);
+    pch_put_type(p, ty->ptr);
+    pch_put_int(p, ty->len);
+    if (!ty->fields) {
+        pch_put_int(p, -1);
+    } else {
+        Vector *keys = dict_keys(ty->fields);
+        pch_put_int(p, vec_len(keys));
+        for (int i = 0; i < vec_len(keys); i++) {
+            char *key = vec_get(keys, i);
+            pch_put_str(p, key);
+            pch_put_type(p, dict_get(ty->fields, key));
+        }
+    }
+    pch_put_int(p, ty->offset);
+    pch_put_int(p, ty->bitoff);
+    pch_put_int(p, ty->bitsize);
+    pch_put_type(p, ty->rettype);
+    if (!ty->params) {
+        pch_put_int(p, -1);
+    } else {
+        pch_put_int(p, vec_len(ty->params));
+        for (int i = 0; i < vec_len(ty->params); i++)
+            pch_put_type(p, vec_get(ty->params, i));
+    }
+}
+
+// Only nodes that can be bound in the global environment are saved.
+void pch_put_node(Pch *p, Node *node) {
+    if (!put_ref(p, node))
+        return;
+    pch_put_int(p, node->kind);
+    pch_put_type(p, node->ty);
+    switch (node->kind) {
+    case AST_GVAR:
+        pch_put_str(p, node->varname);
+        pch_put_str(p, node->glabel);
+        break;
+    case AST_LITERAL:
+        if (!is_inttype(node->ty))
+            error("internal error: cannot save a non-integer literal");
+        put_long(p, node->ival);
+        break;
+    case AST_TYPEDEF:
+        break;
+    default:
+        error("internal error: cannot save node: %s", node2s(node));
+    }
+}
+
+void pch_put_token(Pch *p, Token *tok) {
+    pch_put_int(p, tok->kind);
+    if (put_ref(p, tok->file)) {
+        pch_put_str(p, tok->file->name);
+        pch_put_int(p, tok->file->line);
+    }
+    pch_put_int(p, tok->line);
+    pch_put_int(p, tok->column);
+    pch_put_int(p, tok->space | tok->bol << 1);
+    pch_put_int(p, tok->count);
+    Set *hs = tok->hideset;
+    pch_put_int(p, hs ? hs->len : 0);
+    for (int i = 0; hs && i < hs->len; i++)
+        pch_put_str(p, hs->v[i]);
+    switch (tok->kind) {
+    case TKEYWORD:
+        pch_put_int(p, tok->id);
+        break;
+    case TIDENT:
+    case TNUMBER:
+        pch_put_str(p, tok->sval);
+        break;
+    case TSTRING:
+        put_bytes(p, tok->sval, tok->slen);
+        pch_put_int(p, tok->enc);
+        break;
+    case TCHAR:
+    case TINVALID:
+        pch_put_int(p, tok->c);
+        pch_put_int(p, tok->enc);
+        break;
+    case TMACRO_PARAM:
+        pch_put_int(p, tok->is_vararg);
+        pch_put_int(p, tok->position);
+        break;
+    }
+}
+
+/*
+ * Reader
+ */
+
+static void corrupt(void) {
+    error("precompiled header is corrupt");
+}
+
+int pch_get_int(Pch *p) {
+    if (p->end - p->p < 4)
+        corrupt();
+    int r;
+    memcpy(&r, p->p, sizeof(r));
+    p->p += 4;
+    return r;
+}
+
+static long get_long(Pch *p) {
+    unsigned long lo = (unsigned)pch_get_int(p);
+    long hi = pch_get_int(p);
+    return (long)(hi << 32 | lo);
+}
+
+static char *get_bytes(Pch *p, int len) {
+    if (len < 0 || p->end - p->p <= len)
+        corrupt();
+    char *r = p->p;
+    p->p += (len + 4) & ~3;
+    return r;
+}
+
+// Returns a string in the mapped file.
+char *pch_get_str(Pch *p) {
+    int len = pch_get_int(p);
+    return (len == -1) ? NULL : get_bytes(p, len);
+}
+
+char *pch_get_atom(Pch *p) {
+    char *s = pch_get_str(p);
+    return s ? intern(s) : NULL;
+}
+
+// Returns the object or NULL, or sets *isnew if the object follows.
+static void *get_ref(Pch *p, bool *isnew) {
+    int id = pch_get_int(p);
+    *isnew = (id == NEW_OBJECT);
+    if (*isnew || id == 0)
+        return NULL;
+    if (id < 0 || id > vec_len(p->objs))
+        corrupt();
+    return vec_get(p->objs, id - 1);
+}
+
+Type *pch_get_type(Pch *p) {
+    bool isnew;
+    Type *ty = get_ref(p, &isnew);
+    if (!isnew)
+        return ty;
+    ty = alloc(ALLOC_TYPE, sizeof(Type));
+    vec_push(p->objs, ty);
+    ty->kind = pch_get_int(p);
+    ty->size = pch_get_int(p);
+    ty->align = pch_get_int(p);
+    int flags = pch_get_int(p);
+    ty->usig = flags & 1;
+    ty->isextern = flags >> 1 & 1;
+    ty->isstatic = flags >> 2 & 1;
+    ty->is_struct = flags >> 3 & 1;
+    ty->hasva = flags >> 4 & 1;
+    ty->oldstyle = flags >> 5 & 1;
+    ty->ptr = pch_get_type(p);
+    ty->len = pch_get_int(p);
+    int nfields = pch_get_int(p);
+    if (nfields >= 0) {
+        ty->fields = make_dict();
+        for (int i = 0; i < nfields; i++) {
+            char *key = pch_get_atom(p);
+            dict_put(ty->fields, key, pch_get_type(p));
+        }
+    }
+    ty->offset = pch_get_int(p);
+    ty->bitoff = pch_get_int(p);
+    ty->bitsize = pch_get_int(p);
+    ty->rettype = pch_get_type(p);
+    int nparams = pch_get_int(p);
+    if (nparams >= 0) {
+        ty->params = make_vector();
+        for (int i = 0; i < nparams; i++)
+            vec_push(ty->params, pch_get_type(p));
+    }
+    return ty;
+}
+
+Node *pch_get_node(Pch *p) {
+    bool isnew;
+    Node *node = get_ref(p, &isnew);
+    if (!isnew)
+        return node;
+    node = alloc(ALLOC_GLOBAL, sizeof(Node));
+    vec_push(p->objs, node);
+    node->kind = pch_get_int(p);
+    node->ty = pch_get_type(p);
+    switch (node->kind) {
+    case AST_GVAR:
+        node->varname = pch_get_atom(p);
+        node->glabel = pch_get_str(p);
+        break;
+    case AST_LITERAL:
+        node->ival = get_long(p);
+        break;
+    case AST_TYPEDEF:
+        break;
+    default:
+        corrupt();
+    }
+    return node;
+}
+
+Token *pch_get_token(Pch *p) {
+    Token *tok = alloc(ALLOC_TOKEN, sizeof(Token));
+    tok->kind = pch_get_int(p);
+    bool isnew;
+    tok->file = get_ref(p, &isnew);
+    if (isnew) {
+        tok->file = make_file_string("");
+        tok->file->name = pch_get_str(p);
+        tok->file->line = pch_get_int(p);
+        vec_push(p->objs, tok->file);
+    }
+    tok->line = pch_get_int(p);
+    tok->column = pch_get_int(p);
+    int flags = pch_get_int(p);
+    tok->space = flags & 1;
+    tok->bol = flags >> 1 & 1;
+    tok->count = pch_get_int(p);
+    int nhide = pch_get_int(p);
+    for (int i = 0; i < nhide; i++)
+        tok->hideset = set_add(tok->hideset, pch_get_atom(p));
+    switch (tok->kind) {
+    case TKEYWORD:
+        tok->id = pch_get_int(p);
+        break;
+    case TIDENT:
+        tok->sval = pch_get_atom(p);
+        break;
+    case TNUMBER:
+        tok->sval = pch_get_str(p);
+        break;
+    case TSTRING:
+        tok->slen = pch_get_int(p);
+        tok->sval = get_bytes(p, tok->slen);
+        tok->enc = pch_get_int(p);
+        break;
+    case TCHAR:
+    case TINVALID:
+        tok->c = pch_get_int(p);
+        tok->enc = pch_get_int(p);
+        break;
+    case TMACRO_PARAM:
+        tok->is_vararg = pch_get_int(p);
+        tok->position = pch_get_int(p);
+        break;
+    }
+    return tok;
+}
+
+/*
+ * Precompiled header files
+ */
+
+// The conditions under which a precompiled header can be used
+static void put_config(Pch *p, char *header, char *defs, int first_file) {
+    pch_put_int(p, PCH_MAGIC);
+    pch_put_int(p, PCH_VERSION);
+    pch_put_str(p, fullpath(header));
+    pch_put_str(p, defs);
+    Vector *paths = include_path();
+    pch_put_int(p, vec_len(paths));
+    for (int i = 0; i < vec_len(paths); i++)
+        pch_put_str(p, vec_get(paths, i));
+    Vector *files = input_files();
+    pch_put_int(p, vec_len(files) - first_file);
+    for (int i = first_file; i < vec_len(files); i++) {
+        File *f = vec_get(files, i);
+        pch_put_str(p, fullpath(f->name));
+        put_long(p, f->mtime);
+        put_long(p, f->mtime_ns);
+        put_long(p, f->size);
+    }
+}
+
+/*
+ * The config is read without corrupt(): a truncated or garbled file is
+ * only out of date, and gets rebuilt.
+ */
+static bool read_int(Pch *p, int *r) {
+    if (p->end - p->p < 4)
+        return false;
+    *r = pch_get_int(p);
+    return true;
+}
+
+static bool read_long(Pch *p, long *r) {
+    if (p->end - p->p < 8)
+        return false;
+    *r = get_long(p);
+    return true;
+}
+
+// Reads a string that must be there
+static bool read_str(Pch *p, char **r) {
+    int len;
+    if (!read_int(p, &len) || len < 0 || p->end - p->p <= len || p->p[len])
+        return false;
+    *r = get_bytes(p, len);
+    return true;
+}
+
+static bool check_config(Pch *p, char *header, char *defs) {
+    int magic, version;
+    if (!read_int(p, &magic) || magic != PCH_MAGIC
+        || !read_int(p, &version) || version != PCH_VERSION)
+        return false;
+    char *s;
+    if (!read_str(p, &s) || strcmp(s, fullpath(header)) || !read_str(p, &s) || strcmp(s, defs))
+        return false;
+    Vector *paths = include_path();
+    int npaths;
+    if (!read_int(p, &npaths) || npaths != vec_len(paths))
+        return false;
+    for (int i = 0; i < vec_len(paths); i++)
+        if (!read_str(p, &s) || strcmp(s, vec_get(paths, i)))
+            return false;
+    int nfiles;
+    if (!read_int(p, &nfiles))
+        return false;
+    for (int i = 0; i < nfiles; i++) {
+        char *path;
+        long mtime, mtime_ns, size;
+        if (!read_str(p, &path) || !read_long(p, &mtime) || !read_long(p, &mtime_ns)
+            || !read_long(p, &size))
+            return false;
+        // Nanoseconds and the size catch a change within the same second
+        struct stat st;
+        if (stat(path, &st) || st.st_mtime != mtime || st.st_mtim.tv_nsec != mtime_ns
+            || st.st_size != size)
+            return false;
+    }
+    return true;
+}
+
+static Pch *make_pch(void) {
+    Pch *p = calloc(1, sizeof(Pch));
+    p->objs = make_vector();
+    for (int i = 0; i < NBUILTIN; i++) {
+        add_obj(p, *builtin_types[i]);
+        vec_push(p->objs, *builtin_types[i]);
+    }
+    return p;
+}
+
+/*
+ * Saves the state after reading header to path. first_file is the
+ * index of the header in input_files(), and decls are the toplevels
+ * the header made, which must be declarations without initializers.
+ */
+void save_pch(char *path, char *header, char *defs, int first_file, Vector *decls) {
+    Pch *p = make_pch();
+    p->buf = make_buffer();
+    put_config(p, header, defs, first_file);
+    write_cpp_state(p);
+    write_parse_state(p);
+    pch_put_int(p, vec_len(decls));
+    for (int i = 0; i < vec_len(decls); i++)
+        pch_put_node(p, ((Node *)vec_get(decls, i))->declvar);
+
+    // Write to a temporary file first, so that a concurrent compilation
+    // never sees a partial file.
+    char *tmp = format("%s.%d", path, getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        warn("cannot write %s: %s", tmp, strerror(errno));
+        return;
+    }
+    fwrite(buf_body(p->buf), 1, buf_len(p->buf), fp);
+    if (fclose(fp) || rename(tmp, path)) {
+        warn("cannot write %s: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+// Maps the file at path, or returns NULL.
+static char *map_pch(char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    // Mapped privately so that strings can be used in place.
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return map;
+}
+
+// Returns true if the precompiled header at path is up to date.
+bool pch_is_current(char *path, char *header, char *defs) {
+    size_t size;
+    char *map = map_pch(path, &size);
+    if (!map)
+        return false;
+    Pch p = { .p = map, .end = map + size };
+    bool r = check_config(&p, header, defs);
+    munmap(map, size);
+    return r;
+}
+
+/*
+ * Loads the state saved for header, and returns the declarations to
+ * emit. Returns NULL if there is no precompiled header at path or it
+ * is out of date.
+ */
+Vector *load_pch(char *path, char *header, char *defs) {
+    size_t size;
+    char *map = map_pch(path, &size);
+    if (!map)
+        return NULL;
+    Pch *p = make_pch();
+    p->p = map;
+    p->end = map + size;
+    if (!check_config(p, header, defs)) {
+        munmap(map, size);
+        return NULL;
+    }
+    // The mapping is never released, as nothing is in 8cc.
+    read_cpp_state(p);
+    read_parse_state(p);
+    Vector *decls = make_vector();
+    int ndecls = pch_get_int(p);
+    for (int i = 0; i < ndecls; i++) {
+        Node *decl = alloc(ALLOC_GLOBAL, sizeof(Node));
+        decl->kind = AST_DECL;
+        decl->declvar = pch_get_node(p);
+        vec_push(decls, decl);
+    }
+    return decls;
+}
@@ -0,0 +1,885 @@
+/*
+ * Peephole optimizer for the 65816 backend.
+ *
+ * gen.c collects the assembly of a function as a vector of Insns and
+ * hands it to peephole() before writing it out. The rules below work on
+ * short windows of adjacent instructions; comments are transparent, and
+ * labels and other directives end a window. Rules that delete code ask
+ * live_after() whether a register or the flags are still needed, which follows
+ * branches a few levels deep. Rules are applied until none of them fires.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+/* a run of this many ply is cheaper as tsc/adc/tcs */
+#define PLY_CHAIN_MIN 3
+
+/* bounds the work on jumps that chase each other in a cycle */
+#define MAX_PASSES 16
+
+/* how many branches live_after() follows */
+#define LIVE_DEPTH 4
+
+/* machine state tracked by live_after() */
+enum {
+    R_X = 1,
+    R_NZ = 2,
+    R_C = 4,
+    R_Y = 8,
+    R_ALL = R_X | R_NZ | R_C | R_Y,
+};
+
+typedef struct {
+    char *op;
+    int reads;
+    int writes; /* written without being read first */
+} OpInfo;
+
+static OpInfo ops[] = {
+    { "lda", 0, R_NZ },
+    { "ldx", 0, R_X | R_NZ },
+    { "ldy", 0, R_Y | R_NZ },
+    { "sta", 0, 0 },
+    { "stx", R_X, 0 },
+    { "sty", R_Y, 0 },
+    { "stz", 0, 0 },
+    { "pha", 0, 0 },
+    { "phx", R_X, 0 },
+    { "phy", R_Y, 0 },
+    { "phb", 0, 0 },
+    { "phd", 0, 0 },
+    { "pla", 0, R_NZ },
+    { "plx", 0, R_X | R_NZ },
+    { "ply", 0, R_Y | R_NZ },
+    { "pld", 0, R_NZ },
+    { "tax", 0, R_X | R_NZ },
+    { "tay", 0, R_Y | R_NZ },
+    { "tsx", 0, R_X | R_NZ },
+    { "tyx", R_Y, R_X | R_NZ },
+    { "txa", R_X, R_NZ },
+    { "txy", R_X, R_Y | R_NZ },
+    { "txs", R_X, 0 },
+    { "tya", R_Y, R_NZ },
+    { "tsc", 0, R_NZ },
+    { "tcs", 0, 0 },
+    { "tdc", 0, R_NZ },
+    { "tcd", 0, R_NZ },
+    { "xba", 0, R_NZ },
+    { "and", 0, R_NZ },
+    { "ora", 0, R_NZ },
+    { "eor", 0, R_NZ },
+    { "bit", 0, R_NZ },
+    { "inc", 0, R_NZ },
+    { "dec", 0, R_NZ },
+    { "iny", R_Y, R_NZ },
+    { "dey", R_Y, R_NZ },
+    { "inx", R_X, R_NZ },
+    { "dex", R_X, R_NZ },
+    { "cmp", 0, R_NZ | R_C },
+    { "cpx", R_X, R_NZ | R_C },
+    { "cpy", R_Y, R_NZ | R_C },
+    { "asl", 0, R_NZ | R_C },
+    { "lsr", 0, R_NZ | R_C },
+    { "rol", R_C, R_NZ | R_C },
+    { "ror", R_C, R_NZ | R_C },
+    { "adc", R_C, R_NZ | R_C },
+    { "sbc", R_C, R_NZ | R_C },
+    { "clc", 0, R_C },
+    { "sec", 0, R_C },
+    { "rep", 0, 0 },
+    { "sep", 0, 0 },
+    { "bcc", R_C, 0 },
+    { "bcs", R_C, 0 },
+    { "beq", R_NZ, 0 },
+    { "bne", R_NZ, 0 },
+    { "bmi", R_NZ, 0 },
+    { "bpl", R_NZ, 0 },
+    { "bra", 0, 0 },
+    { "brl", 0, 0 },
+    { "jmp", 0, 0 },
+    { "jml", 0, 0 },
+    /* X has the high word of the return value or of the last argument */
+    { "rtl", R_X, 0 },
+    { "rts", R_X, 0 },
+    { "jsl", R_X, R_ALL },
+};
+
+Insn *make_insn(int line, char *text) {
+    Insn *r = calloc(1, sizeof(Insn));
+    r->line = line;
+    r->text = text;
+    if (text[0] == ';') {
+        r->kind = INSN_COMMENT;
+    } else if (text[0] == '\t') {
+        char *p = text + 1;
+        char *sp = strchr(p, ' ');
+        r->op = sp ? format("%.*s", (int)(sp - p), p) : p;
+        r->arg = sp ? sp + 1 : NULL;
+        if (p[0] != '.')
+            r->kind = INSN_OP;
+        else if (!strcmp(p, ".a8") || !strcmp(p, ".a16") || !strcmp(p, ".i8") || !strcmp(p, ".i16"))
+            r->kind = INSN_MODE;
+        else
+            r->kind = INSN_OTHER;
+    } else {
+        int len = strlen(text);
+        if (len > 0 && text[len - 1] == ':') {
+            r->kind = INSN_LABEL;
+            r->op = format("%.*s", len - 1, text);
+        } else {
+            r->kind = INSN_OTHER;
+        }
+    }
+    return r;
+}
+
+static Insn *make_op(int line, char *op, char *arg) {
+    return make_insn(line, arg ? format("\t%s %s", op, arg) : format("\t%s", op));
+}
+
+static bool is_op(Insn *p, char *op) {
+    return p && p->kind == INSN_OP && !strcmp(p->op, op);
+}
+
+static bool same_arg(Insn *a, Insn *b) {
+    return a->arg && b->arg && !strcmp(a->arg, b->arg);
+}
+
+static OpInfo *op_info(Insn *p) {
+    for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++)
+        if (!strcmp(p->op, ops[i].op))
+            return &ops[i];
+    return NULL;
+}
+
+/* unknown instructions are assumed to read everything */
+static int op_reads(Insn *p) {
+    OpInfo *info = op_info(p);
+    if (!info)
+        return R_ALL;
+    int r = info->reads;
+    if (p->arg && (strstr(p->arg, ",X") || strstr(p->arg, ",x")))
+        r |= R_X;
+    if (p->arg && (strstr(p->arg, ",Y") || strstr(p->arg, ",y")))
+        r |= R_Y;
+    return r;
+}
+
+static int op_writes(Insn *p) {
+    OpInfo *info = op_info(p);
+    return info ? info->writes : 0;
+}
+
+static bool is_cond_branch(Insn *p) {
+    return is_op(p, "bcc") || is_op(p, "bcs") || is_op(p, "beq") || is_op(p, "bne")
+        || is_op(p, "bmi") || is_op(p, "bpl") || is_op(p, "bvc") || is_op(p, "bvs");
+}
+
+static bool is_jump(Insn *p) {
+    return is_op(p, "bra") || is_op(p, "brl") || is_op(p, "jmp") || is_op(p, "jml");
+}
+
+/* true if control never falls through p */
+static bool is_terminator(Insn *p) {
+    return is_jump(p) || is_op(p, "rtl") || is_op(p, "rts") || is_op(p, "rti");
+}
+
+/* true if p only sets A and the flags */
+static bool loads_a(Insn *p) {
+    return is_op(p, "lda") || is_op(p, "tsc") || is_op(p, "tdc")
+        || is_op(p, "txa") || is_op(p, "tya");
+}
+
+/*
+ * true if dropping p cannot lose a memory read: register transfers,
+ * immediates, stack relative operands and direct page, which is either
+ * the scratch area or the frame. Absolute, long and indirect operands
+ * may be memory mapped registers.
+ */
+static bool is_pure_load(Insn *p) {
+    char *s = p->arg;
+    if (!s || s[0] == '#')
+        return true;
+    if (s[0] != '$')
+        return false;
+    for (s++; isxdigit(*s); s++)
+        ;
+    return !*s || !strcmp(s, ",S");
+}
+
+/* true if p sets A without looking at its old value */
+static bool clobbers_a(Insn *p) {
+    return is_op(p, "lda") || is_op(p, "pla") || is_op(p, "tsc") || is_op(p, "tdc")
+        || is_op(p, "txa") || is_op(p, "tya");
+}
+
+/* true if p sets N and Z from the accumulator */
+static bool sets_nz_from_a(Insn *p) {
+    if (clobbers_a(p) || is_op(p, "and") || is_op(p, "ora") || is_op(p, "eor")
+        || is_op(p, "adc") || is_op(p, "sbc"))
+        return true;
+    /* accumulator forms only */
+    return !p->arg && (is_op(p, "inc") || is_op(p, "dec") || is_op(p, "asl")
+                       || is_op(p, "lsr") || is_op(p, "rol") || is_op(p, "ror"));
+}
+
+/* branch target, stripping an address size prefix */
+static char *jump_target(Insn *p) {
+    char *s = p->arg;
+    if (s && s[0] && s[1] == ':')
+        return s + 2;
+    return s;
+}
+
+/* target of a direct jump or branch, NULL for indirect jumps */
+static char *direct_target(Insn *p) {
+    char *s = jump_target(p);
+    return (s && s[0] != '(' && s[0] != '[') ? s : NULL;
+}
+
+/* index of the next instruction after i that is not a comment, or -1 */
+static int next(Vector *v, int i) {
+    for (i++; i < vec_len(v); i++) {
+        Insn *p = vec_get(v, i);
+        if (p->kind != INSN_COMMENT)
+            return i;
+    }
+    return -1;
+}
+
+static Insn *get(Vector *v, int i) {
+    return i < 0 ? NULL : vec_get(v, i);
+}
+
+static int find_label(Vector *v, char *label) {
+    for (int i = 0; i < vec_len(v); i++) {
+        Insn *p = vec_get(v, i);
+        if (p->kind == INSN_LABEL && !strcmp(p->op, label))
+            return i;
+    }
+    return -1;
+}
+
+/* true if any of res may be read after i before being overwritten */
+static bool live_after(Vector *v, int i, int res, int depth) {
+    for (i = next(v, i); i >= 0; i = next(v, i)) {
+        Insn *p = vec_get(v, i);
+        if (p->kind == INSN_LABEL || p->kind == INSN_MODE)
+            continue;
+        if (p->kind != INSN_OP)
+            return true;
+        if (op_reads(p) & res)
+            return true;
+        res &= ~op_writes(p);
+        if (!res)
+            return false;
+        if (is_cond_branch(p) || is_jump(p)) {
+            int t = find_label(v, jump_target(p));
+            if (depth == 0 || t < 0 || live_after(v, t, res, depth - 1))
+                return true;
+            if (is_jump(p))
+                return false;
+        } else if (is_terminator(p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool flags_live_after(Vector *v, int i) {
+    return live_after(v, i, R_NZ | R_C, LIVE_DEPTH);
+}
+
+/* true if the accumulator is 8 bit wide at i */
+static bool a8_at(Vector *v, int i) {
+    for (; i >= 0; i--) {
+        Insn *p = vec_get(v, i);
+        if (p->kind == INSN_MODE && !strcmp(p->op, ".a8"))
+            return true;
+        if (p->kind == INSN_MODE && !strcmp(p->op, ".a16"))
+            return false;
+    }
+    return false;
+}
+
+/* replaces v[from..to] with seq */
+static void splice(Vector *v, int from, int to, Vector *seq) {
+    Vector *r = make_vector();
+    for (int i = 0; i < from; i++)
+        vec_push(r, vec_get(v, i));
+    vec_append(r, seq);
+    for (int i = to + 1; i < vec_len(v); i++)
+        vec_push(r, vec_get(v, i));
+    *v = *r;
+}
+
+static void kill(Vector *v, int i) {
+    Insn *p = vec_get(v, i);
+    p->kind = INSN_COMMENT;
+    p->text = NULL;
+}
+
+/* first instruction at label, skipping over other labels */
+static Insn *insn_at_label(Vector *v, char *label) {
+    int i = find_label(v, label);
+    if (i < 0)
+        return NULL;
+    for (i = next(v, i); i >= 0; i = next(v, i)) {
+        Insn *p = vec_get(v, i);
+        if (p->kind != INSN_LABEL)
+            return p;
+    }
+    return NULL;
+}
+
+/* true if label follows i with nothing but comments and labels between */
+static bool falls_into(Vector *v, int i, char *label) {
+    for (i = next(v, i); i >= 0; i = next(v, i)) {
+        Insn *p = vec_get(v, i);
+        if (p->kind != INSN_LABEL)
+            return false;
+        if (!strcmp(p->op, label))
+            return true;
+    }
+    return false;
+}
+
+static bool is_ident_char(char c) {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || c == '_';
+}
+
+/* true if s mentions label as a whole word */
+static bool mentions(char *s, char *label) {
+    int len = strlen(label);
+    for (char *p = s; p && (p = strstr(p, label)); p += len)
+        if ((p == s || !is_ident_char(p[-1])) && !is_ident_char(p[len]))
+            return true;
+    return false;
+}
+
+static bool label_used(Vector *v, char *label) {
+    for (int i = 0; i < vec_len(v); i++) {
+        Insn *p = vec_get(v, i);
+        if (p->kind == INSN_OP && p->arg && mentions(p->arg, label))
+            return true;
+        if (p->kind == INSN_OTHER && mentions(p->text, label))
+            return true;
+    }
+    return false;
+}
+
+/* true if label looks like it came from make_label() */
+static bool is_local_label(char *label) {
+    char *p = label + (label[0] == '_');
+    if (*p++ != 'L' || !*p)
+        return false;
+    for (; *p; p++)
+        if (*p < '0' || '9' < *p)
+            return false;
+    return true;
+}
+
+/*
+ * pha; pla         -> (nothing)
+ * pha; ply         -> tay
+ * tay; tya         -> tay, same for tax; txa
+ */
+static bool peep_transfers(Vector *v, int i) {
+    Insn *a = get(v, i);
+    int j = next(v, i);
+    Insn *b = get(v, j);
+    if (is_op(a, "pha") && is_op(b, "pla") && !flags_live_after(v, j)) {
+        kill(v, i);
+        kill(v, j);
+        return true;
+    }
+    if (is_op(a, "pha") && is_op(b, "ply") && !a8_at(v, i)) {
+        vec_set(v, i, make_op(a->line, "tay", NULL));
+        kill(v, j);
+        return true;
+    }
+    if ((is_op(a, "tay") && is_op(b, "tya")) || (is_op(a, "tax") && is_op(b, "txa"))) {
+        kill(v, j);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * rep #$20; .a16; sep #$20; .a8   -> (nothing)
+ * and the same with rep and sep swapped
+ */
+static bool peep_mode(Vector *v, int i) {
+    Insn *a = get(v, i);
+    if (!is_op(a, "rep") && !is_op(a, "sep"))
+        return false;
+    int j = next(v, i);
+    Insn *am = get(v, j);
+    int k = next(v, j);
+    Insn *b = get(v, k);
+    int l = next(v, k);
+    Insn *bm = get(v, l);
+    if (!am || am->kind != INSN_MODE || !bm || bm->kind != INSN_MODE)
+        return false;
+    if (!is_op(b, is_op(a, "rep") ? "sep" : "rep") || !same_arg(a, b))
+        return false;
+    kill(v, i);
+    kill(v, j);
+    kill(v, k);
+    kill(v, l);
+    return true;
+}
+
+/*
+ * lda x; lda y     -> lda y, same for txa, tya, ... on either side
+ * sta x; lda x     -> sta x
+ * pha; lda $01,S   -> pha
+ * ldx x            -> (nothing) if X is overwritten before it is read,
+ *                     same for ldy and tay
+ * The dropped loads must not read memory that may have side effects.
+ */
+static bool peep_loads(Vector *v, int i) {
+    Insn *a = get(v, i);
+    int j = next(v, i);
+    Insn *b = get(v, j);
+    if (loads_a(a) && is_pure_load(a) && clobbers_a(b)) {
+        kill(v, i);
+        return true;
+    }
+    if (is_op(a, "sta") && is_op(b, "lda") && same_arg(a, b) && !flags_live_after(v, j)) {
+        kill(v, j);
+        return true;
+    }
+    if (is_op(a, "pha") && is_op(b, "lda") && !strcmp(b->arg, "$01,S")
+        && !a8_at(v, i) && !flags_live_after(v, j)) {
+        kill(v, j);
+        return true;
+    }
+    if (is_op(a, "ldx") && is_pure_load(a) && !live_after(v, i, R_X | R_NZ, LIVE_DEPTH)) {
+        kill(v, i);
+        return true;
+    }
+    if ((is_op(a, "ldy") || is_op(a, "tay")) && is_pure_load(a) && !live_after(v, i, R_Y | R_NZ, LIVE_DEPTH)) {
+        kill(v, i);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * cmp x            -> (nothing) if the flags are not read
+ * lda x; cmp #0    -> lda x, unless the carry is read
+ */
+static bool peep_compares(Vector *v, int i) {
+    Insn *a = get(v, i);
+    if ((is_op(a, "cmp") || is_op(a, "cpx") || is_op(a, "cpy")) && !flags_live_after(v, i)) {
+        kill(v, i);
+        return true;
+    }
+    if (!sets_nz_from_a(a))
+        return false;
+    int j = next(v, i);
+    Insn *b = get(v, j);
+    if (!is_op(b, "cmp") || (strcmp(b->arg, "#$0000") && strcmp(b->arg, "#$00")))
+        return false;
+    if (live_after(v, j, R_C, LIVE_DEPTH))
+        return false;
+    kill(v, j);
+    return true;
+}
+
+/*
+ * bra L; L:        -> L:, same for conditional branches
+ * jmp L; ... L: jmp M   -> jmp M; ... L: jmp M, same for branches
+ * code after an unconditional jump up to the next label is dropped.
+ *
+ * A retargeted branch may end up out of range; relax_branches() picks
+ * the long form for it afterwards.
+ */
+static bool peep_jumps(Vector *v, int i) {
+    Insn *a = get(v, i);
+    if (is_jump(a) || is_cond_branch(a)) {
+        if (falls_into(v, i, jump_target(a))) {
+            kill(v, i);
+            return true;
+        }
+        Insn *t = insn_at_label(v, jump_target(a));
+        if (is_jump(t) && direct_target(t) && strcmp(direct_target(t), jump_target(a))) {
+            char *label = direct_target(t);
+            bool jml = is_op(a, "jmp") || is_op(a, "jml");
+            vec_set(v, i, make_op(a->line, a->op, jml ? format("f:%s", label) : label));
+            return true;
+        }
+    }
+    if (!is_terminator(a))
+        return false;
+    int j = next(v, i);
+    Insn *b = get(v, j);
+    if (b && b->kind == INSN_OP) {
+        kill(v, j);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * [phb;] ply; ply; ... -> tay; tsc; clc; adc #n; tcs; tya
+ */
+static bool peep_ply_chain(Vector *v, int i) {
+    Insn *a = get(v, i);
+    bool odd = is_op(a, "phb");
+    if (!odd && !is_op(a, "ply"))
+        return false;
+    int n = odd ? 0 : 1;
+    int last = i;
+    for (int j = next(v, i); is_op(get(v, j), "ply"); j = next(v, j)) {
+        last = j;
+        n++;
+    }
+    if (n < PLY_CHAIN_MIN || flags_live_after(v, last))
+        return false;
+    int line = a->line;
+    Vector *seq = make_vector();
+    vec_push(seq, make_op(line, "tay", NULL));
+    vec_push(seq, make_op(line, "tsc", NULL));
+    vec_push(seq, make_op(line, "clc", NULL));
+    vec_push(seq, make_op(line, "adc", format("#$%04x", n * 2 - (odd ? 1 : 0))));
+    vec_push(seq, make_op(line, "tcs", NULL));
+    vec_push(seq, make_op(line, "tya", NULL));
+    splice(v, i, last, seq);
+    return true;
+}
+
+/* drops labels from make_label() that nothing refers to */
+static bool drop_unused_labels(Vector *v) {
+    bool r = false;
+    for (int i = 0; i < vec_len(v); i++) {
+        Insn *p = vec_get(v, i);
+        if (p->kind != INSN_LABEL || !is_local_label(p->op))
+            continue;
+        /* data labels may be referred to from other functions */
+        Insn *q = get(v, next(v, i));
+        if (q && q->kind == INSN_OTHER)
+            continue;
+        if (!label_used(v, p->op)) {
+            kill(v, i);
+            r = true;
+        }
+    }
+    return r;
+}
+
+static void compact(Vector *v) {
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(v); i++) {
+        Insn *p = vec_get(v, i);
+        if (p->kind != INSN_COMMENT || p->text)
+            vec_push(r, p);
+    }
+    *v = *r;
+}
+
+void peephole(Vector *insns) {
+    static bool (*rules[])(Vector *, int) = {
+        peep_transfers,
+        peep_mode,
+        peep_loads,
+        peep_compares,
+        peep_jumps,
+        peep_ply_chain,
+    };
+    bool changed = true;
+    for (int pass = 0; changed && pass < MAX_PASSES; pass++) {
+        changed = drop_unused_labels(insns);
+        for (int i = 0; i < vec_len(insns); i++) {
+            Insn *p = vec_get(insns, i);
+            if (p->kind != INSN_OP)
+                continue;
+            for (int r = 0; r < sizeof(rules) / sizeof(*rules); r++) {
+                if (rules[r](insns, i)) {
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        compact(insns);
+    }
+}
+
+/*
+ * Instruction sizes and cycles
+ *
+ * Sizes are upper bounds, as branch relaxation needs: a bare symbol is
+ * assumed to be a long address. Cycles are for native mode with the
+ * direct page aligned, no page crossings and branches taken.
+ */
+
+enum {
+    AM_IMPLIED,   /* no operand, or the accumulator */
+    AM_IMM,       /* #value */
+    AM_DP,        /* $12, $12,X */
+    AM_SR,        /* $12,S */
+    AM_DP_IND,    /* ($12), ($12),Y */
+    AM_DP_LONG,   /* [$12], [$12],Y */
+    AM_SR_IND,    /* ($12,S),Y */
+    AM_ABS,       /* $1234, a:sym, (abs,X) */
+    AM_LONG,      /* $123456, f:sym, and symbols */
+};
+
+static int addr_mode(char *a) {
+    if (!a || !strcmp(a, "a"))
+        return AM_IMPLIED;
+    if (a[0] == '#')
+        return AM_IMM;
+    if (a[0] == '[')
+        return AM_DP_LONG;
+    if (a[0] == '(') {
+        if (strstr(a, ",S)") || strstr(a, ",s)"))
+            return AM_SR_IND;
+        return strspn(a + 2, "0123456789abcdefABCDEF") <= 2 ? AM_DP_IND : AM_ABS;
+    }
+    if (strstr(a, ",S") || strstr(a, ",s"))
+        return AM_SR;
+    if (!strncmp(a, "a:", 2))
+        return AM_ABS;
+    if (a[0] == '$') {
+        int digits = strspn(a + 1, "0123456789abcdefABCDEF");
+        return digits <= 2 ? AM_DP : digits <= 4 ? AM_ABS : AM_LONG;
+    }
+    return AM_LONG;
+}
+
+static bool is_directive(Insn *p, char *name) {
+    char *s = p->text + (p->text[0] == '\t');
+    return !strncmp(s, name, strlen(name));
+}
+
+/* number of comma separated items in s */
+static int count_items(char *s) {
+    int n = 1;
+    for (; *s; s++)
+        if (*s == ',')
+            n++;
+    return n;
+}
+
+/* upper bound of the bytes p assembles to */
+static int insn_size(Insn *p) {
+    if (p->kind == INSN_OTHER) {
+        if (is_directive(p, ".addr") || is_directive(p, ".word"))
+            return 2 * count_items(p->arg);
+        if (is_directive(p, ".dword"))
+            return 4 * count_items(p->arg);
+        if (is_directive(p, ".byte"))
+            return strlen(p->arg);
+        return 0;
+    }
+    if (p->kind != INSN_OP)
+        return 0;
+    if (is_cond_branch(p) || is_op(p, "bra"))
+        return 2;
+    if (is_op(p, "brl") || is_op(p, "jsr"))
+        return 3;
+    if (is_op(p, "jsl") || is_op(p, "jml"))
+        return 4;
+    if (is_op(p, "jmp"))
+        return strncmp(p->arg, "f:", 2) ? 3 : 4;
+    if (is_op(p, "rep") || is_op(p, "sep"))
+        return 2;
+    switch (addr_mode(p->arg)) {
+    case AM_IMPLIED: return 1;
+    case AM_IMM: return 3;
+    case AM_ABS: return 3;
+    case AM_LONG: return 4;
+    default: return 2;
+    }
+}
+
+typedef struct {
+    char *op;
+    int cycles;
+    char wide; /* one more cycle if this register is 16 bit: 'm', 'x' or 0 */
+} OpCycles;
+
+/* instructions whose cost does not depend on the operand */
+static OpCycles fixed_cycles[] = {
+    { "pha", 3, 'm' }, { "phx", 3, 'x' }, { "phy", 3, 'x' },
+    { "pla", 4, 'm' }, { "plx", 4, 'x' }, { "ply", 4, 'x' },
+    { "php", 3 }, { "plp", 4 }, { "phb", 3 }, { "plb", 4 },
+    { "phd", 4 }, { "pld", 5 }, { "phk", 3 },
+    { "pea", 5 }, { "pei", 6 }, { "per", 6 },
+    { "rep", 3 }, { "sep", 3 }, { "xba", 3 }, { "xce", 2 },
+    { "bra", 3 }, { "brl", 4 }, { "jml", 4 },
+    { "jsr", 6 }, { "jsl", 8 }, { "rts", 6 }, { "rtl", 6 }, { "rti", 7 },
+    { "mvn", 7 }, { "mvp", 7 }, { "wai", 3 },
+};
+
+/* cycles of a load or store by addressing mode, with 8-bit data */
+static int mem_cycles[] = {
+    [AM_IMPLIED] = 2, [AM_IMM] = 2, [AM_DP] = 3, [AM_SR] = 4,
+    [AM_DP_IND] = 5, [AM_DP_LONG] = 6, [AM_SR_IND] = 7,
+    [AM_ABS] = 4, [AM_LONG] = 5,
+};
+
+static bool is_rmw(Insn *p) {
+    return is_op(p, "inc") || is_op(p, "dec") || is_op(p, "asl") || is_op(p, "lsr")
+        || is_op(p, "rol") || is_op(p, "ror") || is_op(p, "tsb") || is_op(p, "trb");
+}
+
+static bool uses_index_reg(Insn *p) {
+    return is_op(p, "ldx") || is_op(p, "ldy") || is_op(p, "stx") || is_op(p, "sty")
+        || is_op(p, "cpx") || is_op(p, "cpy");
+}
+
+/*
+ * Bytes and cycles of p for -fcost-report. m8 and x8 tell if the
+ * accumulator and the index registers are 8 bit wide at p.
+ */
+void insn_cost(Insn *p, bool m8, bool x8, int *bytes, int *cycles) {
+    *bytes = insn_size(p);
+    *cycles = 0;
+    if (p->kind != INSN_OP)
+        return;
+    int mode = addr_mode(p->arg);
+    bool wide_data = uses_index_reg(p) ? !x8 : !m8;
+    if (mode == AM_IMM && !wide_data && !is_op(p, "rep") && !is_op(p, "sep"))
+        (*bytes)--;
+    for (int i = 0; i < sizeof(fixed_cycles) / sizeof(*fixed_cycles); i++) {
+        OpCycles *c = &fixed_cycles[i];
+        if (strcmp(p->op, c->op))
+            continue;
+        *cycles = c->cycles + ((c->wide == 'm' && !m8) || (c->wide == 'x' && !x8));
+        return;
+    }
+    if (is_cond_branch(p)) {
+        *cycles = 3;
+    } else if (is_op(p, "jmp")) {
+        *cycles = !strncmp(p->arg, "f:", 2) ? 4 : p->arg[0] == '(' ? 6 : 3;
+    } else if (mode == AM_IMPLIED) {
+        *cycles = 2;
+    } else if (is_rmw(p)) {
+        *cycles = (mode == AM_DP ? 5 : 6) + (wide_data ? 2 : 0);
+    } else {
+        *cycles = mem_cycles[mode] + wide_data;
+    }
+}
+
+/*
+ * Branch relaxation
+ *
+ * gen.c emits relative branches without knowing how far they reach,
+ * and jumps to labels of the same function as 4-byte jml. Once the
+ * function is complete, it is laid out with an upper bound on the size
+ * of every instruction. Each branch to a local label then gets the
+ * shortest form that reaches it: bra or a conditional branch if the
+ * target is within a signed byte, otherwise brl or an inverted branch
+ * around a brl.
+ */
+
+/* conditional branch plus brl */
+#define LONG_BRANCH_SIZE 5
+
+// Returns the branch taken when op is not. Also used by gen.c.
+char *invert_branch(char *op) {
+    static char *pairs[][2] = {
+        { "bcc", "bcs" }, { "beq", "bne" }, { "bmi", "bpl" }, { "bvc", "bvs" },
+    };
+    for (int i = 0; i < sizeof(pairs) / sizeof(*pairs); i++) {
+        if (!strcmp(op, pairs[i][0]))
+            return pairs[i][1];
+        if (!strcmp(op, pairs[i][1]))
+            return pairs[i][0];
+    }
+    error("internal error: not a branch: %s", op);
+}
+
+/*
+ * bcc L1; jmp f:L2; L1:  ->  bcs L2
+ *
+ * gen.c branches around a jump where it cannot know the distance.
+ */
+static void merge_branch_over_jump(Vector *v) {
+    for (int i = 0; i < vec_len(v); i++) {
+        Insn *a = vec_get(v, i);
+        if (!is_cond_branch(a))
+            continue;
+        int j = next(v, i);
+        Insn *b = get(v, j);
+        if (!is_jump(b) || !direct_target(b) || find_label(v, direct_target(b)) < 0)
+            continue;
+        if (!falls_into(v, j, jump_target(a)))
+            continue;
+        char *skip = jump_target(a);
+        vec_set(v, i, make_op(a->line, invert_branch(a->op), direct_target(b)));
+        kill(v, j);
+        if (is_local_label(skip) && !label_used(v, skip))
+            kill(v, find_label(v, skip));
+    }
+}
+
+void relax_branches(Vector *v) {
+    merge_branch_over_jump(v);
+    compact(v);
+
+    int n = vec_len(v);
+    int *target = calloc(n, sizeof(int));
+    bool *far = calloc(n, sizeof(bool));
+    int *addr = calloc(n + 1, sizeof(int));
+
+    /* jumps to local labels become branches, for now assumed short */
+    for (int i = 0; i < n; i++) {
+        Insn *p = vec_get(v, i);
+        target[i] = -1;
+        if (!is_jump(p) && !is_cond_branch(p))
+            continue;
+        char *label = direct_target(p);
+        target[i] = label ? find_label(v, label) : -1;
+        if (target[i] >= 0 && !is_cond_branch(p) && !is_op(p, "bra"))
+            vec_set(v, i, make_op(p->line, "bra", label));
+    }
+
+    /* a branch only ever grows, so this terminates */
+    for (bool changed = true; changed;) {
+        changed = false;
+        bool code = true;
+        for (int i = 0; i < n; i++) {
+            Insn *p = vec_get(v, i);
+            int size = 0;
+            if (p->kind == INSN_OTHER && is_directive(p, ".segment"))
+                code = strstr(p->text, "\"C_CODE\"") != NULL;
+            else if (code && target[i] >= 0)
+                size = !far[i] ? 2 : is_cond_branch(p) ? LONG_BRANCH_SIZE : 3;
+            else if (code)
+                size = insn_size(p);
+            addr[i + 1] = addr[i] + size;
+        }
+        for (int i = 0; i < n; i++) {
+            if (target[i] < 0 || far[i])
+                continue;
+            int disp = addr[target[i]] - (addr[i] + 2);
+            if (disp < -128 || 127 < disp) {
+                far[i] = true;
+                changed = true;
+            }
+        }
+    }
+
+    Vector *r = make_vector();
+    for (int i = 0; i < n; i++) {
+        Insn *p = vec_get(v, i);
+        if (target[i] < 0 || !far[i]) {
+            vec_push(r, p);
+        } else if (is_cond_branch(p)) {
+            char *skip = make_label();
+            vec_push(r, make_op(p->line, invert_branch(p->op), skip));
+            vec_push(r, make_op(p->line, "brl", p->arg));
+            vec_push(r, make_insn(p->line, format("%s:", skip)));
+        } else {
+            vec_push(r, make_op(p->line, "brl", p->arg));
+        }
+    }
+    *v = *r;
+}
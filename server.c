@@ -0,0 +1,382 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+/*
+ * Compile server.
+ *
+ * "8cc --server=SOCKET [options]" waits for requests on a Unix domain
+ * socket. "8cc --connect=SOCKET args..." sends its arguments, working
+ * directory and standard file descriptors to the server, which
+ * compiles as if 8cc had been run with those arguments in that
+ * directory. Output files are written by the server; diagnostics go
+ * straight to the client's stderr, and the client exits with the
+ * status of the compilation.
+ *
+ * What is read before the source file depends only on the working
+ * directory and the -I, -D, -U and -fpch options. For each set of
+ * them, the server keeps a process, a zygote, that has done that work
+ * once: it has the macros defined and the precompiled header loaded.
+ * Each request is compiled in a process forked from the zygote for its
+ * options, so it starts from that state and cannot leave anything
+ * behind for the next request. A zygote whose precompiled header has
+ * gone out of date is replaced by a new one.
+ *
+ * A request is the length of the payload, sent along with the client's
+ * stdin, stdout and stderr, followed by the payload: the working
+ * directory and the arguments as NUL-terminated strings. The server
+ * passes the request on to the zygote in the same form, with the
+ * connection to the client as an extra descriptor. The reply is the
+ * exit status as an int, then the length of and the names of the
+ * assembly files made, as NUL-terminated strings. A status of -1 means
+ * the server could not take the request.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "8cc.h"
+
+#define NFDS 3
+
+typedef struct {
+    pid_t pid;
+    int sock; // the server's end of a socket pair
+} Zygote;
+
+static Compiler *cc;
+static int server_sock;
+static Map *zygotes = &EMPTY_MAP;
+
+// The connection a request process replies on, and its status
+static int reply_sock = -1;
+static pid_t reply_pid;
+static int reply_status = 1;
+
+static struct sockaddr_un make_addr(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        error("socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+static bool write_all(int fd, char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Receives a payload length along with n file descriptors.
+static bool recv_header(int sock, int *len, int *fds, int n) {
+    char control[CMSG_SPACE(sizeof(int) * (NFDS + 1))];
+    struct iovec iov = { len, sizeof(*len) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int) * n),
+    };
+    if (recvmsg(sock, &msg, 0) != sizeof(*len))
+        return false;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n))
+        return false;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+    return true;
+}
+
+static bool send_header(int sock, int len, int *fds, int n) {
+    char control[CMSG_SPACE(sizeof(int) * (NFDS + 1))] = {};
+    struct iovec iov = { &len, sizeof(len) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int) * n),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    return sendmsg(sock, &msg, 0) == sizeof(len);
+}
+
+// Reads a payload of len bytes. Returns NULL if it is malformed.
+static char *read_payload(int sock, int len) {
+    if (len <= 0)
+        return NULL;
+    char *payload = malloc(len);
+    if (!read_all(sock, payload, len) || payload[len - 1] != '\0') {
+        free(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+static Vector *split_payload(char *payload, int len) {
+    Vector *r = make_vector();
+    for (char *p = payload; p < payload + len; p += strlen(p) + 1)
+        vec_push(r, p);
+    return r;
+}
+
+static void close_fds(int *fds, int n) {
+    for (int i = 0; i < n; i++)
+        close(fds[i]);
+}
+
+static void send_reply(int sock, int status, Vector *outputs) {
+    Buffer *b = make_buffer();
+    for (int i = 0; outputs && i < vec_len(outputs); i++) {
+        char *s = vec_get(outputs, i);
+        buf_append(b, s, strlen(s) + 1);
+    }
+    int len = buf_len(b);
+    write_all(sock, (char *)&status, sizeof(status));
+    write_all(sock, (char *)&len, sizeof(len));
+    write_all(sock, buf_body(b), len);
+}
+
+// Replies when a request process exits, including on errors, which
+// exit right away. Children of the request process do not reply.
+static void reply_at_exit() {
+    if (reply_sock < 0 || getpid() != reply_pid)
+        return;
+    send_reply(reply_sock, reply_status, reply_status ? NULL : cc->outputs());
+    reply_sock = -1;
+}
+
+// Compiles a request in a process forked from a zygote. fds are the
+// connection to the client and the client's stdin, stdout and stderr.
+static noreturn void serve(int *fds, char *payload, int len) {
+    reply_sock = fds[0];
+    reply_pid = getpid();
+    for (int i = 0; i < NFDS; i++) {
+        dup2(fds[i + 1], i);
+        close(fds[i + 1]);
+    }
+    // Files of -j are waited for, which SIG_IGN prevents
+    signal(SIGCHLD, SIG_DFL);
+    if (atexit(reply_at_exit))
+        perror("atexit");
+    init_now();
+    // The zygote runs in the working directory already. It takes the
+    // place of argv[0].
+    Vector *args = split_payload(payload, len);
+    vec_set(args, 0, "8cc");
+    vec_push(args, NULL);
+    reply_status = cc->compile(vec_len(args) - 1, vec_body(args));
+    exit(reply_status);
+}
+
+static noreturn void run_zygote(int sock) {
+    for (;;) {
+        int len;
+        int fds[NFDS + 1];
+        if (!recv_header(sock, &len, fds, NFDS + 1))
+            exit(0);
+        char *payload = read_payload(sock, len);
+        // A zygote that is out of date leaves; the server makes a new one.
+        char taken = payload && cc->is_current();
+        pid_t pid = taken ? fork() : -1;
+        if (pid == 0) {
+            close(sock);
+            serve(fds, payload, len);
+        }
+        taken = (pid > 0);
+        write_all(sock, &taken, 1);
+        if (!taken)
+            exit(0);
+        close_fds(fds, NFDS + 1);
+        free(payload);
+    }
+}
+
+// fds are the descriptors of the request being handled, if any, which
+// the zygote must not keep open.
+static Zygote *make_zygote(char *cwd, Vector *config, int *fds, int nfds) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        warn("socketpair failed: %s", strerror(errno));
+        return NULL;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(server_sock);
+        close(sv[0]);
+        close_fds(fds, nfds);
+        Vector *others = map_keys(zygotes);
+        for (int i = 0; i < vec_len(others); i++)
+            close(((Zygote *)map_get(zygotes, vec_get(others, i)))->sock);
+        if (chdir(cwd))
+            error("cannot change directory to %s: %s", cwd, strerror(errno));
+        cc->warm_up(config);
+        run_zygote(sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        warn("fork failed: %s", strerror(errno));
+        close(sv[0]);
+        return NULL;
+    }
+    Zygote *z = malloc(sizeof(Zygote));
+    z->pid = pid;
+    z->sock = sv[0];
+    return z;
+}
+
+static void drop_zygote(char *key, Zygote *z) {
+    close(z->sock);
+    kill(z->pid, SIGTERM);
+    map_remove(zygotes, key);
+    free(z);
+}
+
+// The cache key for a working directory and options.
+static char *config_key(char *cwd, Vector *config) {
+    Buffer *b = make_buffer();
+    buf_printf(b, "%zu:%s", strlen(cwd), cwd);
+    for (int i = 0; i < vec_len(config); i++) {
+        char *s = vec_get(config, i);
+        buf_printf(b, "%zu:%s", strlen(s), s);
+    }
+    return buf_body(b);
+}
+
+// Returns the zygote for the options, making one if there is none.
+static Zygote *get_zygote(char *key, char *cwd, Vector *config, int *fds, int nfds) {
+    Zygote *z = map_get(zygotes, key);
+    if (!z && (z = make_zygote(cwd, config, fds, nfds)))
+        map_put(zygotes, key, z);
+    return z;
+}
+
+// Passes a request to the zygote for its options, and returns true if
+// it was taken. A zygote that is out of date or dead is replaced once.
+static bool dispatch(int conn, int *fds, char *payload, int len) {
+    Vector *args = split_payload(payload, len);
+    char *cwd = vec_head(args);
+    // getopt permutes its arguments, so it gets a copy
+    Vector *argv = vec_copy(args);
+    vec_set(argv, 0, "8cc");
+    vec_push(argv, NULL);
+    Vector *config = cc->config(vec_len(argv) - 1, vec_body(argv));
+    char *key = config_key(cwd, config);
+    int sendfds[NFDS + 1] = { conn, fds[0], fds[1], fds[2] };
+    for (int i = 0; i < 2; i++) {
+        Zygote *z = get_zygote(key, cwd, config, sendfds, NFDS + 1);
+        if (!z)
+            return false;
+        char taken = 0;
+        if (send_header(z->sock, len, sendfds, NFDS + 1)
+            && write_all(z->sock, payload, len)
+            && read_all(z->sock, &taken, 1) && taken)
+            return true;
+        drop_zygote(key, z);
+    }
+    return false;
+}
+
+noreturn void run_server(char *path, Compiler *compiler, int argc, char **argv) {
+    cc = compiler;
+    struct sockaddr_un addr = make_addr(path);
+    server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_sock < 0)
+        error("socket failed: %s", strerror(errno));
+    unlink(path);
+    if (bind(server_sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(server_sock, 64))
+        error("cannot listen on %s: %s", path, strerror(errno));
+    // Zygotes and requests are never waited for
+    signal(SIGCHLD, SIG_IGN);
+    // A dead zygote is noticed by a failed write
+    signal(SIGPIPE, SIG_IGN);
+
+    // Options given to the server make a zygote right away, so that the
+    // first request with them does not wait for it.
+    if (argc > 1) {
+        char *cwd = getcwd(NULL, 0);
+        if (!cwd)
+            error("getcwd failed: %s", strerror(errno));
+        Vector *config = cc->config(argc, argv);
+        get_zygote(config_key(cwd, config), cwd, config, NULL, 0);
+    }
+
+    for (;;) {
+        int conn = accept(server_sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            error("accept failed: %s", strerror(errno));
+        }
+        int len;
+        int fds[NFDS];
+        if (recv_header(conn, &len, fds, NFDS)) {
+            char *payload = read_payload(conn, len);
+            if (!payload || !dispatch(conn, fds, payload, len))
+                send_reply(conn, -1, NULL);
+            free(payload);
+            close_fds(fds, NFDS);
+        }
+        close(conn);
+    }
+}
+
+/*
+ * Sends the arguments to the server at path and returns the exit
+ * status of the compilation, or -1 if there is no server or it could
+ * not take the request.
+ */
+int run_client(char *path, int argc, char **argv) {
+    struct sockaddr_un addr = make_addr(path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(sock);
+        return -1;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        error("getcwd failed: %s", strerror(errno));
+    Buffer *b = make_buffer();
+    buf_append(b, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < argc; i++)
+        buf_append(b, argv[i], strlen(argv[i]) + 1);
+    int fds[NFDS] = { 0, 1, 2 };
+    int status, len;
+    if (!send_header(sock, buf_len(b), fds, NFDS)
+        || !write_all(sock, buf_body(b), buf_len(b))
+        || !read_all(sock, (char *)&status, sizeof(status))
+        || !read_all(sock, (char *)&len, sizeof(len)))
+        error("lost connection to %s", path);
+    // The names of the assembly files are not needed here, as they
+    // are the ones 8cc would have made.
+    if (len < 0)
+        error("lost connection to %s", path);
+    char *outputs = malloc(len);
+    if (!read_all(sock, outputs, len))
+        error("lost connection to %s", path);
+    free(outputs);
+    close(sock);
+    return status;
+}
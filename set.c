@@ -8,41 +8,151 @@
 //
 // A null pointer represents an empty set.
 //
-// Set is designed with simplicity in mind.
-// It should be very fast for small number of items.
-// However, if you plan to add a lot of items to a set,
-// you should consider using Map as a set.
+// Elements are compared by pointer, so they must be atoms returned
+// by intern(). The names of identifier tokens are atoms.
+//
+// Sets are the hidesets of the preprocessor, of which every token
+// has one. A set is a sorted array of atoms, and sets are hash-consed:
+// equal sets are the same object. That keeps the many tokens that
+// share a hideset from each holding a copy of it, and lets union and
+// intersection merge two arrays in linear time.
 
 #include <stdlib.h>
 #include <string.h>
 #include "8cc.h"
 
-Set *set_add(Set *s, char *v) {
-    Set *r = malloc(sizeof(Set));
-    r->next = s;
-    r->v = v;
+#define INIT_SIZE 256
+
+// All sets ever made, an open addressing hash table
+static Set **table;
+static int size;
+static int nelem;
+
+// Scratch space to build sets in
+static char **scratch;
+static int scratch_size;
+
+static bool before(char *a, char *b) {
+    return (uintptr_t)a < (uintptr_t)b;
+}
+
+static void rehash(void) {
+    int newsize = size ? size * 2 : INIT_SIZE;
+    Set **t = calloc(newsize, sizeof(Set *));
+    int mask = newsize - 1;
+    for (int i = 0; i < size; i++) {
+        if (!table[i])
+            continue;
+        int j = table[i]->hash & mask;
+        while (t[j])
+            j = (j + 1) & mask;
+        t[j] = table[i];
+    }
+    free(table);
+    table = t;
+    size = newsize;
+}
+
+// Returns the set of the len sorted atoms in v.
+static Set *make_set(char **v, int len) {
+    if (len == 0)
+        return NULL;
+    if (nelem * 2 >= size)
+        rehash();
+    // The hash of the pointers, not of the strings
+    uint32_t h = fnv_hash(v, len * sizeof(char *));
+    int mask = size - 1;
+    int i = h & mask;
+    for (; table[i]; i = (i + 1) & mask) {
+        Set *s = table[i];
+        if (s->hash == h && s->len == len && !memcmp(s->v, v, len * sizeof(char *)))
+            return s;
+    }
+    Set *r = alloc(ALLOC_SET, sizeof(Set) + len * sizeof(char *));
+    r->len = len;
+    r->hash = h;
+    memcpy(r->v, v, len * sizeof(char *));
+    table[i] = r;
+    nelem++;
     return r;
 }
 
+static int set_len(Set *s) {
+    return s ? s->len : 0;
+}
+
+static char **get_scratch(int len) {
+    if (scratch_size < len) {
+        scratch_size = len * 2;
+        scratch = realloc(scratch, scratch_size * sizeof(char *));
+    }
+    return scratch;
+}
+
+Set *set_add(Set *s, char *v) {
+    if (set_has(s, v))
+        return s;
+    int len = set_len(s);
+    char **r = get_scratch(len + 1);
+    int i = 0;
+    for (; i < len && before(s->v[i], v); i++)
+        r[i] = s->v[i];
+    r[i] = v;
+    for (; i < len; i++)
+        r[i + 1] = s->v[i];
+    return make_set(r, len + 1);
+}
+
 bool set_has(Set *s, char *v) {
-    for (; s; s = s->next)
-        if (!strcmp(s->v, v))
+    for (int i = 0; i < set_len(s); i++) {
+        if (s->v[i] == v)
             return true;
+        if (before(v, s->v[i]))
+            return false;
+    }
     return false;
 }
 
 Set *set_union(Set *a, Set *b) {
-    Set *r = b;
-    for (; a; a = a->next)
-        if (!set_has(b, a->v))
-            r = set_add(r, a->v);
-    return r;
+    if (!a || a == b)
+        return b;
+    if (!b)
+        return a;
+    char **r = get_scratch(a->len + b->len);
+    int i = 0, j = 0, n = 0;
+    while (i < a->len && j < b->len) {
+        if (a->v[i] == b->v[j]) {
+            r[n++] = a->v[i++];
+            j++;
+        } else if (before(a->v[i], b->v[j])) {
+            r[n++] = a->v[i++];
+        } else {
+            r[n++] = b->v[j++];
+        }
+    }
+    while (i < a->len)
+        r[n++] = a->v[i++];
+    while (j < b->len)
+        r[n++] = b->v[j++];
+    return make_set(r, n);
 }
 
 Set *set_intersection(Set *a, Set *b) {
-    Set *r = NULL;
-    for (; a; a = a->next)
-        if (set_has(b, a->v))
-            r = set_add(r, a->v);
-    return r;
+    if (!a || !b)
+        return NULL;
+    if (a == b)
+        return a;
+    char **r = get_scratch(a->len < b->len ? a->len : b->len);
+    int i = 0, j = 0, n = 0;
+    while (i < a->len && j < b->len) {
+        if (a->v[i] == b->v[j]) {
+            r[n++] = a->v[i++];
+            j++;
+        } else if (before(a->v[i], b->v[j])) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return make_set(r, n);
 }
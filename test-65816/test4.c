@@ -0,0 +1,23 @@
+// Dense cases go through a jump table.
+int dense(int x) {
+    switch (x) {
+    case 1: return 10;
+    case 2: return 20;
+    case 3: return 30;
+    case 5: return 50;
+    case 6: return 60;
+    default: return 0;
+    }
+}
+
+// Sparse cases and ranges go through a compare tree.
+unsigned int sparse(unsigned int x) {
+    switch (x) {
+    case 3: return 1;
+    case 100: return 2;
+    case 200 ... 210: return 3;
+    case 1000: return 4;
+    case 30000: return 5;
+    default: return 0;
+    }
+}
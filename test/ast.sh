@@ -8,7 +8,7 @@ function fail {
 }
 
 function compile {
-    echo "$1" | ./8cc -o tmp.s - || fail "Failed to compile $1"
+    echo "$1" | ./8cc -S -o tmp.s - || fail "Failed to compile $1"
     gcc -o tmp.out tmp.s
      [ $? -ne 0 ] && fail "GCC failed: $1"
 }
@@ -18,7 +18,7 @@ function assertequal {
 }
 
 function testastf {
-    result="$(echo "$2" | ./8cc -o - -fdump-ast -w -)"
+    result="$(echo "$2" | ./8cc -S -o - -fdump-ast -fno-fold -w -)"
     [ $? -ne 0 ] && fail "Failed to compile $2"
     assertequal "$result" "$1"
 }
@@ -27,13 +27,19 @@ function testast {
     testastf "$1" "int f(){$2}"
 }
 
+function testfold {
+    result="$(echo "int f(){$2}" | ./8cc -S -o - -fdump-ast -w -)"
+    [ $? -ne 0 ] && fail "Failed to compile $2"
+    assertequal "$result" "$1"
+}
+
 function testm {
     compile "$2"
     assertequal "$(./tmp.out)" "$1"
 }
 
 function testcpp {
-    echo "$2" | ./8cc -o - -E $3 - > tmp.s || fail "Failed to compile $1"
+    echo "$2" | ./8cc -S -o - -E $3 - > tmp.s || fail "Failed to compile $1"
     assertequal "$(cat tmp.s)" "$1"
 }
 
@@ -41,65 +47,88 @@ function testcpp {
 function testfail {
     echo "$expr" | ./8cc -o /dev/null - 2> /dev/null
     expr="int f(){$1}"
-    echo "$expr" | ./8cc -o /dev/null $OPTION - 2> /dev/null
+    echo "$expr" | ./8cc -S -o /dev/null $OPTION - 2> /dev/null
     [ $? -eq 0 ] && fail "Should fail to compile, but succeded: $expr"
 }
 
 # Parser
-testast '(()=>int)f(){1;}' '1;'
-testast '(()=>int)f(){1L;}' '1L;'
+testast '(()=>uint)_f(){1;}' '1;'
+testast '(()=>uint)_f(){1L;}' '1L;'
 # testast '(()=>int)f(){1152921504606846976L;}' '1152921504606846976;'
-testast '(()=>int)f(){(+ (- (+ 1 2) 3) 4);}' '1+2-3+4;'
-testast '(()=>int)f(){(+ (+ 1 (* 2 3)) 4);}' '1+2*3+4;'
-testast '(()=>int)f(){(+ (* 1 2) (* 3 4));}' '1*2+3*4;'
-testast '(()=>int)f(){(+ (/ 4 2) (/ 6 3));}' '4/2+6/3;'
-testast '(()=>int)f(){(/ (/ 24 2) 4);}' '24/2/4;'
-testast '(()=>int)f(){(decl int a 3@0);}' 'int a=3;'
-testast "(()=>int)f(){(decl char c (conv 97=>char)@0);}" "char c='a';"
-testast '(()=>int)f(){(decl *char s (conv "abcd"=>*char)@0);}' 'char *s="abcd";'
+testast '(()=>uint)_f(){(+ (- (+ 1 2) 3) 4);}' '1+2-3+4;'
+testast '(()=>uint)_f(){(+ (+ 1 (* 2 3)) 4);}' '1+2*3+4;'
+testast '(()=>uint)_f(){(+ (* 1 2) (* 3 4));}' '1*2+3*4;'
+testast '(()=>uint)_f(){(+ (/ 4 2) (/ 6 3));}' '4/2+6/3;'
+testast '(()=>uint)_f(){(/ (/ 24 2) 4);}' '24/2/4;'
+testast '(()=>uint)_f(){(decl uint a 3@0);}' 'int a=3;'
+testast "(()=>uint)_f(){(decl uchar c (conv 97=>uchar)@0);}" "char c='a';"
+testast '(()=>uint)_f(){(decl *uchar s (conv "abcd"=>*uchar)@0);}' 'char *s="abcd";'
 #testast "(()=>int)f(){(decl [5]char s 'a'@0 's'@1 'd'@2 'f'@3 '\0'@4);}" 'char s[5]="asdf";'
-testast "(()=>int)f(){(decl [5]char s 'a'@0 's'@1 'd'@2 'f'@3 '\0'@4);}" 'char s[]="asdf";'
-testast '(()=>int)f(){(decl [3]int a 1@0 2@4 3@8);}' 'int a[3]={1,2,3};'
-testast '(()=>int)f(){(decl [3]int a 1@0 2@4 3@8);}' 'int a[]={1,2,3};'
-testast '(()=>int)f(){(decl [3][5]int a);}' 'int a[3][5];'
-testast '(()=>int)f(){(decl [5]*int a);}' 'int *a[5];'
-testast '(()=>int)f(){(decl int a 1@0);(decl int b 2@0);(= lv=a (= lv=b 3));}' 'int a=1;int b=2;a=b=3;'
-testast '(()=>int)f(){(decl int a 3@0);(addr lv=a);}' 'int a=3;&a;'
-testast '(()=>int)f(){(decl int a 3@0);(deref (addr lv=a));}' 'int a=3;*&a;'
-testast '(()=>int)f(){(decl int a 3@0);(decl *int b (addr lv=a)@0);(deref lv=b);}' 'int a=3;int *b=&a;*b;'
-testast '(()=>int)f(){(if 1 {2;});}' 'if(1){2;}'
-testast '(()=>int)f(){(if 1 {2;} {3;});}' 'if(1){2;}else{3;}'
-testast '(()=>int)f(){{{(decl int a 1@0);};.L0:;(if 3 (nil) goto(.L2));{5;};.L1:;7;goto(.L0);.L2:;};}' 'for(int a=1;3;7){5;}'
-testast '(()=>int)f(){"abcd";}' '"abcd";'
-testast "(()=>int)f(){99;}" "'c';"
-testast '(()=>int)f(){(int)a();}' 'a();'
-testast '(()=>int)f(){(int)a(1,2,3,4,5,6);}' 'a(1,2,3,4,5,6);'
-testast '(()=>int)f(){(return (conv 1=>int));}' 'return 1;'
-testast '(()=>int)f(){(< 1 2);}' '1<2;'
-testast '(()=>int)f(){(< 2 1);}' '1>2;'
-testast '(()=>int)f(){(== 1 2);}' '1==2;'
+testast "(()=>uint)_f(){(decl [5]uchar s 'a'@0 's'@1 'd'@2 'f'@3 '\0'@4);}" 'char s[]="asdf";'
+testast '(()=>uint)_f(){(decl [3]uint a 1@0 2@2 3@4);}' 'int a[3]={1,2,3};'
+testast '(()=>uint)_f(){(decl [3]uint a 1@0 2@2 3@4);}' 'int a[]={1,2,3};'
+testast '(()=>uint)_f(){(decl [3][5]uint a);}' 'int a[3][5];'
+testast '(()=>uint)_f(){(decl [5]*uint a);}' 'int *a[5];'
+testast '(()=>uint)_f(){(decl uint a 1@0);(decl uint b 2@0);(= lv=a (= lv=b 3));}' 'int a=1;int b=2;a=b=3;'
+testast '(()=>uint)_f(){(decl uint a 3@0);(addr lv=a);}' 'int a=3;&a;'
+testast '(()=>uint)_f(){(decl uint a 3@0);(deref (addr lv=a));}' 'int a=3;*&a;'
+testast '(()=>uint)_f(){(decl uint a 3@0);(decl *uint b (addr lv=a)@0);(deref lv=b);}' 'int a=3;int *b=&a;*b;'
+testast '(()=>uint)_f(){(if 1 {2;});}' 'if(1){2;}'
+testast '(()=>uint)_f(){(if 1 {2;} {3;});}' 'if(1){2;}else{3;}'
+testast '(()=>uint)_f(){{{(decl uint a 1@0);};_L0:;(if 3 (nil) goto(_L2));{5;};_L1:;7;goto(_L0);_L2:;};}' 'for(int a=1;3;7){5;}'
+testast '(()=>uint)_f(){"abcd";}' '"abcd";'
+testast "(()=>uint)_f(){99;}" "'c';"
+testast '(()=>uint)_f(){(int)_a();}' 'a();'
+testast '(()=>uint)_f(){(int)_a(1,2,3,4,5,6);}' 'a(1,2,3,4,5,6);'
+testast '(()=>uint)_f(){(return (conv 1=>uint));}' 'return 1;'
+testast '(()=>uint)_f(){(< 1 2);}' '1<2;'
+testast '(()=>uint)_f(){(< 2 1);}' '1>2;'
+testast '(()=>uint)_f(){(== 1 2);}' '1==2;'
 # testast '(()=>int)f(){(deref (+ 1 2));}' '1[2];'
-testast '(()=>int)f(){(decl int a 1@0);(post++ lv=a);}' 'int a=1;a++;'
-testast '(()=>int)f(){(decl int a 1@0);(post-- lv=a);}' 'int a=1;a--;'
-testast '(()=>int)f(){(! 1);}' '!1;'
-testast '(()=>int)f(){(? 1 2 3);}' '1?2:3;'
-testast '(()=>int)f(){(and 1 2);}' '1&&2;'
-testast '(()=>int)f(){(or 1 2);}' '1||2;'
-testast '(()=>int)f(){(& 1 2);}' '1&2;'
-testast '(()=>int)f(){(| 1 2);}' '1|2;'
-testast '(()=>int)f(){1.200000;}' '1.2;'
-testast '(()=>int)f(){(+ 1.200000 (conv 1=>double));}' '1.2+1;'
-
-testastf '((int)=>int)f(int lv=c){lv=c;}' 'int f(int c){c;}'
-testastf '((int)=>int)f(int lv=c){lv=c;}((int)=>int)g(int lv=d){lv=d;}' 'int f(int c){c;} int g(int d){d;}'
-testastf '(decl int a 3@0)' 'int a=3;'
+testast '(()=>uint)_f(){(decl uint a 1@0);(post++ lv=a);}' 'int a=1;a++;'
+testast '(()=>uint)_f(){(decl uint a 1@0);(post-- lv=a);}' 'int a=1;a--;'
+testast '(()=>uint)_f(){(! 1);}' '!1;'
+testast '(()=>uint)_f(){(? 1 2 3);}' '1?2:3;'
+testast '(()=>uint)_f(){(and 1 2);}' '1&&2;'
+testast '(()=>uint)_f(){(or 1 2);}' '1||2;'
+testast '(()=>uint)_f(){(& 1 2);}' '1&2;'
+testast '(()=>uint)_f(){(| 1 2);}' '1|2;'
+testast '(()=>uint)_f(){1.200000;}' '1.2;'
+testast '(()=>uint)_f(){(+ 1.200000 (conv 1=>double));}' '1.2+1;'
+
+testastf '((uint)=>uint)_f(uint lv=c){lv=c;}' 'int f(int c){c;}'
+testastf $'((uint)=>uint)_f(uint lv=c){lv=c;}\n((uint)=>uint)_g(uint lv=d){lv=d;}' 'int f(int c){c;} int g(int d){d;}'
+testastf '(decl uint a 3@0)' 'int a=3;'
+testastf '((uint)=>uint)_f(uint lv=a){{(switch lv=a 1:_L1 3...5:_L2 default:_L3);{{_L1:;(return (conv 2=>uint));};{_L2:;goto(_L0);};{_L3:;(return (conv 0=>uint));};};_L0:;};}' 'int f(int a){switch(a){case 1: return 2; case 3 ... 5: break; default: return 0;}}'
 
 testastf '(decl (struct) a)' 'struct {} a;'
-testastf '(decl (struct (int) (char)) a)' 'struct {int x; char y;} a;'
-testastf '(decl (struct ([3]int)) a)' 'struct {int x[3];} a;'
-testast '(()=>int)f(){(decl (struct (int)) a);(decl *(struct (int)) p);(deref lv=p).x;}' 'struct tag {int x;} a; struct tag *p; p->x;'
-testast '(()=>int)f(){(decl (struct (int)) a);lv=a.x;}' 'struct {int x;} a; a.x;'
-testast '(()=>int)f(){(decl (struct (int:0:5) (int:5:13)) x);}' 'struct { int a:5; int b:8; } x;'
+testastf '(decl (struct (uint) (uchar)) a)' 'struct {int x; char y;} a;'
+testastf '(decl (struct ([3]uint)) a)' 'struct {int x[3];} a;'
+testast '(()=>uint)_f(){(decl (struct (uint)) a);(decl *(struct (uint)) p);(deref lv=p).x;}' 'struct tag {int x;} a; struct tag *p; p->x;'
+testast '(()=>uint)_f(){(decl (struct (uint)) a);lv=a.x;}' 'struct {int x;} a; a.x;'
+testast '(()=>uint)_f(){(decl (struct (uint:0:5) (uint:5:13)) x);}' 'struct { int a:5; int b:8; } x;'
+
+# Constant folding
+testfold '(()=>uint)_f(){11;}' '1+2*3+4;'
+testfold '(()=>uint)_f(){65535;}' '~0;'
+testfold '(()=>uint)_f(){0;}' '!5;'
+testfold '(()=>uint)_f(){(decl int x 65533@0);}' 'signed int x=-7/2;'
+testfold '(()=>uint)_f(){1L;}' '4294967295UL*4294967295UL;'
+testfold '(()=>uint)_f(){(decl uint x);(+ lv=x 5);}' 'int x; (x+2)+3;'
+testfold '(()=>uint)_f(){(decl uint x);(+ lv=x 3);}' 'int x; 3+x;'
+testfold '(()=>uint)_f(){(decl uint x);lv=x;}' 'int x; x-1+1;'
+testfold '(()=>uint)_f(){(decl uint x);lv=x;}' 'int x; x*1;'
+testfold '(()=>uint)_f(){(decl uint x);lv=x;}' 'int x; x<<0;'
+testfold '(()=>uint)_f(){(decl uint x);lv=x;}' 'int x; x&0xffff;'
+testfold '(()=>uint)_f(){(decl uint x);0;}' 'int x; x*0;'
+testfold '(()=>uint)_f(){(* (uint)_f() 0);}' 'f()*0;'
+testfold '(()=>uint)_f(){(decl uint x);0;}' 'int x; 0&&x;'
+testfold '(()=>uint)_f(){{2;};}' 'if(1){2;}else{3;}'
+testfold '(()=>uint)_f(){{};}' 'if(0){2;}'
+testfold '(()=>uint)_f(){(decl uint x);3;}' 'int x; 0?x:3;'
+testfold '(()=>uint)_f(){{_L0:;{};goto(_L0);_L1:;};}' 'while(1){}'
+testfold '(()=>uint)_f(){(if 0 {{__L:;};});goto(_L);}' 'if(0){L:;}goto L;'
+testfold '(()=>uint)_f(){{goto(_L2);{{_L1:;(return 2);};{_L2:;goto(_L0);};{_L3:;(return 0);};};_L0:;};}' 'switch(4){case 1: return 2; case 3 ... 5: break; default: return 0;}'
 
 testfail '0abc;'
 # testfail '1+;'
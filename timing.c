@@ -0,0 +1,226 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+/*
+ * -ftime-report
+ *
+ * The compiler is divided into phases, which nest: the parser calls the
+ * preprocessor, which calls the lexer, which reads files. Each phase
+ * is charged with the time and memory spent while it is the innermost
+ * one, so the numbers of all phases add up to the whole compilation.
+ *
+ * On top of that, the report lists the functions that took longest to
+ * generate code for, and the macros whose expansions took longest.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "8cc.h"
+
+#define NTOP 10
+
+bool timereport = false;
+bool timereport_json = false;
+
+typedef struct {
+    char *name;
+    long ns;
+    long calls;
+    size_t allocs;
+    size_t bytes;
+    size_t peak;
+} Phase;
+
+static Phase phases[] = {
+    [PHASE_OTHER] = { "other" },
+    [PHASE_READ] = { "read" },
+    [PHASE_LEX] = { "lex" },
+    [PHASE_CPP] = { "preprocess" },
+    [PHASE_PARSE] = { "parse" },
+    [PHASE_FOLD] = { "fold" },
+    [PHASE_CODEGEN] = { "codegen" },
+};
+
+typedef struct {
+    char *name;
+    long ns;
+    long count;
+} Cost;
+
+static Vector *stack = &EMPTY_VECTOR;
+static long last;
+static size_t last_allocs;
+static size_t last_bytes;
+static Vector *func_costs = &EMPTY_VECTOR;
+static Map *macro_costs = &EMPTY_MAP;
+
+long time_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void timing_start() {
+    last = time_now();
+    vec_push(stack, (void *)PHASE_OTHER);
+}
+
+// Charges what happened since the last phase change to the current phase.
+static void charge() {
+    Phase *p = &phases[(intptr_t)vec_tail(stack)];
+    long t = time_now();
+    p->ns += t - last;
+    last = t;
+    size_t allocs, bytes;
+    alloc_totals(&allocs, &bytes);
+    p->allocs += allocs - last_allocs;
+    p->bytes += bytes - last_bytes;
+    last_allocs = allocs;
+    last_bytes = bytes;
+    size_t peak = alloc_take_peak();
+    if (peak > p->peak)
+        p->peak = peak;
+}
+
+void phase_enter(int phase) {
+    if (!timereport)
+        return;
+    charge();
+    vec_push(stack, (void *)(intptr_t)phase);
+    phases[phase].calls++;
+}
+
+void phase_exit() {
+    if (!timereport)
+        return;
+    charge();
+    vec_pop(stack);
+}
+
+void record_func_time(char *name, long ns) {
+    Cost *c = malloc(sizeof(Cost));
+    *c = (Cost){ name, ns, 1 };
+    vec_push(func_costs, c);
+}
+
+void record_macro_time(char *name, long ns) {
+    Cost *c = map_get(macro_costs, name);
+    if (!c) {
+        c = calloc(1, sizeof(Cost));
+        c->name = name;
+        map_put(macro_costs, name, c);
+    }
+    c->ns += ns;
+    c->count++;
+}
+
+static int cost_cmp(const void *a, const void *b) {
+    long x = (*(Cost **)a)->ns;
+    long y = (*(Cost **)b)->ns;
+    return (x < y) - (x > y);
+}
+
+// Returns the most costly entries of v, the most costly first.
+static Vector *top_costs(Vector *v) {
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(v); i++)
+        vec_push(r, vec_get(v, i));
+    qsort(vec_body(r), vec_len(r), sizeof(void *), cost_cmp);
+    while (vec_len(r) > NTOP)
+        vec_pop(r);
+    return r;
+}
+
+static Vector *macro_list() {
+    Vector *r = make_vector();
+    Vector *names = map_keys(macro_costs);
+    for (int i = 0; i < vec_len(names); i++)
+        vec_push(r, map_get(macro_costs, vec_get(names, i)));
+    return r;
+}
+
+static double ms(long ns) {
+    return ns / 1e6;
+}
+
+static void print_text(char *file, long total, Vector *funcs, Vector *macros) {
+    fprintf(stderr, "time report for %s\n", file);
+    fprintf(stderr, "%-12s %10s %6s %10s %10s %12s %12s\n",
+            "phase", "ms", "%", "calls", "allocs", "bytes", "peak");
+    for (int i = 0; i < PHASE_NUM; i++) {
+        Phase *p = &phases[i];
+        fprintf(stderr, "%-12s %10.3f %5.1f%% %10ld %10zu %12zu %12zu\n",
+                p->name, ms(p->ns), total ? 100.0 * p->ns / total : 0.0,
+                p->calls, p->allocs, p->bytes, p->peak);
+    }
+    fprintf(stderr, "%-12s %10.3f\n", "total", ms(total));
+    if (vec_len(funcs) > 0) {
+        fprintf(stderr, "\n%-32s %10s\n", "function", "ms");
+        for (int i = 0; i < vec_len(funcs); i++) {
+            Cost *c = vec_get(funcs, i);
+            fprintf(stderr, "%-32s %10.3f\n", c->name, ms(c->ns));
+        }
+    }
+    if (vec_len(macros) > 0) {
+        fprintf(stderr, "\n%-32s %10s %10s\n", "macro", "ms", "expansions");
+        for (int i = 0; i < vec_len(macros); i++) {
+            Cost *c = vec_get(macros, i);
+            fprintf(stderr, "%-32s %10.3f %10ld\n", c->name, ms(c->ns), c->count);
+        }
+    }
+}
+
+// Quotes a string for JSON. Bytes of 0x80 and above are left as they
+// are, so that UTF-8 passes through.
+static char *quote_json(char *p) {
+    Buffer *b = make_buffer();
+    for (; *p; p++) {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\')
+            buf_printf(b, "\\%c", c);
+        else if (c < 0x20 || c == 0x7f)
+            buf_printf(b, "\\u%04x", c);
+        else
+            buf_write(b, c);
+    }
+    buf_write(b, '\0');
+    return buf_body(b);
+}
+
+static void print_json_costs(char *key, Vector *v) {
+    fprintf(stderr, ",\n  \"%s\": [", key);
+    for (int i = 0; i < vec_len(v); i++) {
+        Cost *c = vec_get(v, i);
+        fprintf(stderr, "%s\n    {\"name\": \"%s\", \"ms\": %.3f, \"count\": %ld}",
+                i ? "," : "", quote_json(c->name), ms(c->ns), c->count);
+    }
+    fprintf(stderr, "%s]", vec_len(v) ? "\n  " : "");
+}
+
+static void print_json(char *file, long total, Vector *funcs, Vector *macros) {
+    fprintf(stderr, "{\n  \"file\": \"%s\",\n  \"total_ms\": %.3f,\n  \"phases\": {",
+            quote_json(file), ms(total));
+    for (int i = 0; i < PHASE_NUM; i++) {
+        Phase *p = &phases[i];
+        fprintf(stderr, "%s\n    \"%s\": {\"ms\": %.3f, \"calls\": %ld, \"allocs\": %zu, "
+                "\"bytes\": %zu, \"peak\": %zu}",
+                i ? "," : "", p->name, ms(p->ns), p->calls, p->allocs, p->bytes, p->peak);
+    }
+    fprintf(stderr, "\n  }");
+    print_json_costs("functions", funcs);
+    print_json_costs("macros", macros);
+    fprintf(stderr, "\n}\n");
+}
+
+void print_time_report(char *file) {
+    charge();
+    long total = 0;
+    for (int i = 0; i < PHASE_NUM; i++)
+        total += phases[i].ns;
+    Vector *funcs = top_costs(func_costs);
+    Vector *macros = top_costs(macro_list());
+    if (timereport_json)
+        print_json(file, total, funcs, macros);
+    else
+        print_text(file, total, funcs, macros);
+}
@@ -118,6 +118,17 @@ static void test_map_stack() {
     assert_int(1, (int)(intptr_t)map_get(m1, "x"));
 }
 
+static void test_map_atoms() {
+    // Atoms use their cached hash, which must agree with other strings
+    Map *m = make_map();
+    char *abc = intern("abc");
+    map_put(m, abc, (void *)1);
+    assert_int(1, (int)(intptr_t)map_get(m, "abc"));
+    map_put(m, "xyz", (void *)2);
+    assert_int(2, (int)(intptr_t)map_get(m, intern("xyz")));
+    assert_int(2, (int)(intptr_t)map_get(m, intern("wxyz") + 1));
+}
+
 static void test_dict() {
     Dict *dict = make_dict();
     assert_null(dict_get(dict, "abc"));
@@ -130,21 +141,38 @@ static void test_dict() {
 
 static void test_set() {
     Set *s = NULL;
-    assert_int(0, set_has(s, "abc"));
-    s = set_add(s, "abc");
-    s = set_add(s, "def");
-    assert_int(1, set_has(s, "abc"));
-    assert_int(1, set_has(s, "def"));
-    assert_int(0, set_has(s, "xyz"));
+    assert_int(0, set_has(s, intern("abc")));
+    s = set_add(s, intern("abc"));
+    s = set_add(s, intern("def"));
+    assert_int(1, set_has(s, intern("abc")));
+    assert_int(1, set_has(s, intern("def")));
+    assert_int(0, set_has(s, intern("xyz")));
     Set *t = NULL;
-    t = set_add(t, "abc");
-    t = set_add(t, "DEF");
-    assert_int(1, set_has(set_union(s, t), "abc"));
-    assert_int(1, set_has(set_union(s, t), "def"));
-    assert_int(1, set_has(set_union(s, t), "DEF"));
-    assert_int(1, set_has(set_intersection(s, t), "abc"));
-    assert_int(0, set_has(set_intersection(s, t), "def"));
-    assert_int(0, set_has(set_intersection(s, t), "DEF"));
+    t = set_add(t, intern("abc"));
+    t = set_add(t, intern("DEF"));
+    assert_int(1, set_has(set_union(s, t), intern("abc")));
+    assert_int(1, set_has(set_union(s, t), intern("def")));
+    assert_int(1, set_has(set_union(s, t), intern("DEF")));
+    assert_int(1, set_has(set_intersection(s, t), intern("abc")));
+    assert_int(0, set_has(set_intersection(s, t), intern("def")));
+    assert_int(0, set_has(set_intersection(s, t), intern("DEF")));
+    // Equal sets are the same object
+    assert_int(1, set_union(s, t) == set_union(t, s));
+    assert_int(1, set_add(set_add(NULL, intern("def")), intern("abc")) == s);
+    assert_null(set_intersection(s, set_add(NULL, intern("xyz"))));
+}
+
+static void test_intern() {
+    char *abc = intern("abc");
+    assert_int(1, abc == intern("abc"));
+    assert_int(1, abc == intern_len("abcdef", 3));
+    assert_int(0, abc == intern("abd"));
+    assert_int(0, abc == intern("ab"));
+    assert_string("abc", abc);
+    for (int i = 0; i < 5000; i++)
+        intern(format("x%d", i));
+    assert_int(1, abc == intern("abc"));
+    assert_int(1, intern("x4999") == intern(format("x%d", 4999)));
 }
 
 static void test_path() {
@@ -172,15 +200,40 @@ static void test_file() {
     assert_true(readc() < 0);
 }
 
+static void test_read_span() {
+    FILE *fp = tmpfile();
+    fputs("identifier_with_more_than_16_chars$1 \t\v+ comment\\\n"
+          "a\nb*/x", fp);
+    rewind(fp);
+    stream_push(make_file(fp, "span"));
+    char *s;
+    assert_int(36, read_span(SPAN_IDENT, &s));
+    assert_int(0, strncmp("identifier_", s, 11));
+    assert_int(0, read_span(SPAN_IDENT, &s));
+    assert_int(3, read_span(SPAN_SPACE, &s));
+    assert_int('+', readc());
+    assert_int(8, read_span(SPAN_LINE_COMMENT, &s));
+    assert_int('a', readc());
+    assert_int(2, read_span(SPAN_BLOCK_COMMENT, &s));
+    assert_int(3, current_file()->line);
+    assert_int(2, current_file()->column);
+    assert_int('*', readc());
+    unreadc('*');
+    assert_int(0, read_span(SPAN_BLOCK_COMMENT, &s));
+}
+
 int main(int argc, char **argv) {
     test_buf();
     test_list();
     test_map();
     test_map_stack();
+    test_map_atoms();
     test_dict();
     test_set();
+    test_intern();
     test_path();
     test_file();
+    test_read_span();
     printf("Passed\n");
     return 0;
 }